@@ -2,22 +2,231 @@
 #include "config.h"
 #include "gpio.h"
 #include "sercom.h"
+#include "dmac.h"
+#include "evsys.h"
+#include "systick.h"
 
-uint16_t abp_get_pressure(void)
+#define CE_PORT GPIO_PORT_A
+#define CE_PIN 6
+
+// Pressure (status + 14 bits), then temperature (11 bits)
+#define FRAME_SIZE (ABP_TEMPERATURE ? 4 : 2)
+
+#define STATUS_SHIFT 14
+#define PRESSURE_MASK 0x3fff
+
+_Static_assert(ABP_RING_FRAMES % PRESSURE_SAMPLES_PER_INTERRUPT == 0, "PRESSURE_SAMPLES_PER_INTERRUPT must divide ABP_RING_FRAMES");
+
+static const uint32_t ce_mask = (1u << CE_PIN);
+static const uint8_t tx_dummy = 0;
+
+static struct
+{
+    void (*callback)(const struct abp_sample_t *sample);
+    struct abp_sample_t last; // Last fresh sample
+
+    // Sensor update period tracking, in CPU cycles (0 until known)
+    uint32_t period;
+    uint32_t last_update;
+    bool update_seen;
+    bool previous_stale;
+
+    struct sercom_spi_transfer_t transfer;
+    volatile bool pending;
+    uint8_t frame[FRAME_SIZE];
+    uint8_t ring[ABP_RING_FRAMES][FRAME_SIZE];
+    size_t read;
+    struct dmac_descriptor_t tx[2];
+    struct dmac_descriptor_t rx[ABP_RING_FRAMES - 1];
+} context;
+
+/* The sensor flags a sample that was already read as stale: the first fresh
+ * sample after a stale one tells when the sensor updated. Reading again
+ * before the next update is only wasted SPI traffic.
+ */
+static void track(enum abp_status_e status)
+{
+    uint32_t now = systick_now();
+
+    if(status == ABP_STATUS_STALE)
+        context.previous_stale = true;
+    else if(status == ABP_STATUS_FRESH)
+    {
+        if(context.previous_stale)
+        {
+            if(context.update_seen)
+            {
+                uint32_t interval = systick_elapsed(context.last_update, now);
+                if(!context.period)
+                    context.period = interval;
+                else if(interval < 2 * context.period) // Not a missed update
+                    context.period = (7 * context.period + interval) / 8;
+            }
+            context.last_update = now;
+            context.update_seen = true;
+        }
+        else if(context.period)
+            context.period -= context.period / 16; // May be overestimated: read earlier
+        context.previous_stale = false;
+    }
+}
+
+// Whether the sensor cannot have a new sample yet (7/8 of the period for jitter)
+static bool too_early(void)
+{
+    if(!context.period)
+        return false;
+    uint32_t elapsed = systick_elapsed(context.last_update, systick_now());
+    return elapsed < context.period - context.period / 8;
+}
+
+static enum abp_status_e decode(const uint8_t *frame, struct abp_sample_t *sample)
 {
-    uint16_t tx = 0;
-    uint16_t rx;
-    sercom_spi_burst(SERCOM_PRESSURE_CHANNEL, GPIO_PORT_A, 6, &rx, &tx, sizeof(rx));
-    return (rx << 8) | (rx >> 8);
+    uint16_t raw = (frame[0] << 8) | frame[1];
+    switch(raw >> STATUS_SHIFT)
+    {
+        case 0x0:
+            sample->status = ABP_STATUS_FRESH;
+            break;
+        case 0x2:
+            sample->status = ABP_STATUS_STALE;
+            break;
+        default: // Command mode, diagnostic condition
+            sample->status = ABP_STATUS_FAULT;
+            break;
+    }
+    sample->pressure = (raw & PRESSURE_MASK);
+#if ABP_TEMPERATURE
+    sample->temperature = (frame[2] << 3) | (frame[3] >> 5);
+#else
+    sample->temperature = 0;
+#endif
+
+    track(sample->status);
+    if(sample->status == ABP_STATUS_FRESH)
+        context.last = *sample;
+    return sample->status;
 }
 
-uint16_t abp_wait_until_valid_pressure(void)
+/* Never blocks on the sensor: a stale sample is reported as such, along with
+ * the last fresh values, and no frame is read before the sensor can have
+ * updated
+ */
+enum abp_status_e abp_read(struct abp_sample_t *sample)
 {
-    for(;;)
+    if(too_early())
     {
-        uint16_t pressure = abp_get_pressure();
-        if((pressure & 0xc0000) == 0) // Status bits should be 0
-            return (pressure & 0xfff); // 12bit resolution
+        *sample = context.last;
+        sample->status = ABP_STATUS_STALE;
+        return ABP_STATUS_STALE;
     }
+
+    uint8_t tx[FRAME_SIZE] = {0};
+    uint8_t frame[FRAME_SIZE];
+    sercom_spi_burst(SERCOM_PRESSURE_CHANNEL, CE_PORT, CE_PIN, frame, tx, FRAME_SIZE);
+    return decode(frame, sample);
+}
+
+static void on_transfer(struct sercom_spi_transfer_t *transfer)
+{
+    (void) transfer;
+
+    struct abp_sample_t sample;
+    context.pending = false;
+    decode(context.frame, &sample);
+    context.callback(&sample);
+}
+
+/* Asynchronous read: callback is called from the SERCOM interrupt.
+ * Returns false if the previous read is not over yet, or if the sensor
+ * cannot have a new sample yet.
+ */
+bool abp_request_pressure(void (*callback)(const struct abp_sample_t *sample))
+{
+    if(context.pending || too_early())
+        return false;
+
+    context.callback = callback;
+    context.pending = true;
+    context.transfer.ce_port = CE_PORT;
+    context.transfer.ce_pin = CE_PIN;
+    context.transfer.tx = NULL;
+    context.transfer.rx = context.frame;
+    context.transfer.size = FRAME_SIZE;
+    context.transfer.callback = on_transfer;
+    return sercom_spi_submit(SERCOM_PRESSURE_CHANNEL, &context.transfer);
+}
+
+// DMAC interrupt: PRESSURE_SAMPLES_PER_INTERRUPT new frames are in the ring
+static void on_frames(uint8_t channel)
+{
+    (void) channel;
+
+    for(size_t i = 0; i < PRESSURE_SAMPLES_PER_INTERRUPT; ++i)
+    {
+        struct abp_sample_t sample;
+        decode(context.ring[context.read], &sample);
+        context.read = (context.read + 1) % ABP_RING_FRAMES;
+        context.callback(&sample);
+    }
+}
+
+/*
+ * Each trigger event (e.g. a TC overflow) reads one frame without the CPU:
+ *     TX channel (resumed by the event, paced by DRE):
+ *         /CE low (PORT.OUTCLR) -> dummy bytes to DATA -> suspend
+ *     RX channel (paced by RXC):
+ *         DATA -> ring frame, whose end emits an event to the /CE channel
+ *     /CE channel (triggered by that event):
+ *         /CE high (PORT.OUTSET)
+ * /CE cannot be left to the SERCOM (MSSEN): it would go high between bytes.
+ * The CPU is only interrupted every PRESSURE_SAMPLES_PER_INTERRUPT frames,
+ * and callback is then called from the DMAC interrupt with each sample.
+ * abp_read must not be used once sampling is started.
+ */
+void abp_start_sampling(uint8_t trigger_generator, void (*callback)(const struct abp_sample_t *sample))
+{
+    volatile void *data = sercom_spi_data_register(SERCOM_PRESSURE_CHANNEL);
+    volatile uint32_t *ce_low = gpio_output_register(CE_PORT, false);
+    volatile uint32_t *ce_high = gpio_output_register(CE_PORT, true);
+
+    context.callback = callback;
+    context.read = 0;
+
+    // RX: circular list of one-frame blocks over the ring
+    struct dmac_descriptor_t *rx_first = dmac_descriptor(DMAC_PRESSURE_RX_CHANNEL);
+    for(size_t i = 0; i < ABP_RING_FRAMES; ++i)
+    {
+        struct dmac_descriptor_t *desc = (i == 0 ? rx_first : &context.rx[i - 1]);
+        const struct dmac_descriptor_t *next = (i + 1 == ABP_RING_FRAMES ? rx_first : &context.rx[i]);
+        uint16_t btctrl = DMAC_BTCTRL_BEATSIZE_BYTE
+                        | DMAC_BTCTRL_DSTINC
+                        | DMAC_BTCTRL_EVOSEL_BLOCK
+                        | ((i + 1) % PRESSURE_SAMPLES_PER_INTERRUPT == 0 ? DMAC_BTCTRL_BLOCKACT_INT : 0)
+                        ;
+        dmac_describe(desc, btctrl, data, context.ring[i], FRAME_SIZE, next);
+    }
+
+    // /CE high, once per event
+    struct dmac_descriptor_t *ce = dmac_descriptor(DMAC_PRESSURE_CE_CHANNEL);
+    dmac_describe(ce, DMAC_BTCTRL_BEATSIZE_WORD, &ce_mask, ce_high, 1, ce);
+
+    /* TX: the first block only parks the channel in the suspended state
+     * (/CE is already high), the next ones loop over a frame
+     */
+    struct dmac_descriptor_t *tx_park = dmac_descriptor(DMAC_PRESSURE_TX_CHANNEL);
+    dmac_describe(tx_park, DMAC_BTCTRL_BEATSIZE_WORD | DMAC_BTCTRL_BLOCKACT_SUSPEND, &ce_mask, ce_high, 1, &context.tx[0]);
+    dmac_describe(&context.tx[0], DMAC_BTCTRL_BEATSIZE_WORD, &ce_mask, ce_low, 1, &context.tx[1]);
+    dmac_describe(&context.tx[1], DMAC_BTCTRL_BEATSIZE_BYTE | DMAC_BTCTRL_BLOCKACT_SUSPEND, &tx_dummy, data, FRAME_SIZE, &context.tx[0]);
+
+    dmac_configure_channel(DMAC_PRESSURE_RX_CHANNEL, DMAC_TRIGGER_SERCOM_RX(SERCOM_PRESSURE_CHANNEL), DMAC_TRIGACT_BEAT, DMAC_EVACT_NONE, true);
+    dmac_configure_channel(DMAC_PRESSURE_CE_CHANNEL, DMAC_TRIGGER_NONE, DMAC_TRIGACT_BLOCK, DMAC_EVACT_TRIG, false);
+    dmac_configure_channel(DMAC_PRESSURE_TX_CHANNEL, DMAC_TRIGGER_SERCOM_TX(SERCOM_PRESSURE_CHANNEL), DMAC_TRIGACT_BEAT, DMAC_EVACT_RESUME, false);
+    dmac_enable_channel(DMAC_PRESSURE_RX_CHANNEL, on_frames);
+    dmac_enable_channel(DMAC_PRESSURE_CE_CHANNEL, NULL);
+    dmac_enable_channel(DMAC_PRESSURE_TX_CHANNEL, NULL);
+
+    evsys_connect(EVSYS_PRESSURE_END_CHANNEL, EVSYS_GEN_DMAC_CH(DMAC_PRESSURE_RX_CHANNEL), EVSYS_USER_DMAC_CH(DMAC_PRESSURE_CE_CHANNEL));
+    evsys_connect(EVSYS_PRESSURE_START_CHANNEL, trigger_generator, EVSYS_USER_DMAC_CH(DMAC_PRESSURE_TX_CHANNEL));
 }
 
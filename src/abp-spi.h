@@ -2,6 +2,7 @@
 #define ABP_SPI_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #define ABP_MAX_PA         103421u // 15 psi
 #define ABP_10_PERCENT_PA  10342u  // 10% max
@@ -10,8 +11,28 @@
 #define ABP_COUNT_MAX 0x399au
 #define ABP_PA_2_COUNTS(p) (ABP_COUNT_MIN + (int32_t)(((p) * ((float)(ABP_COUNT_MAX - ABP_COUNT_MIN) / (ABP_90_PERCENT_PA - ABP_10_PERCENT_PA)))))
 
-uint16_t abp_get_pressure(void);
-uint16_t abp_wait_until_valid_pressure(void);
+#define ABP_RING_FRAMES 8 // Frames kept in RAM by abp_start_sampling
+
+// Temperature counts to hundredths of degree Celsius (-50C..150C)
+#define ABP_COUNTS_2_CENTI_CELSIUS(t) ((int32_t) (t) * 20000 / 2047 - 5000)
+
+enum abp_status_e
+{
+    ABP_STATUS_FRESH,
+    ABP_STATUS_STALE, // Already read
+    ABP_STATUS_FAULT // Command mode or diagnostic condition
+};
+
+struct abp_sample_t
+{
+    enum abp_status_e status;
+    uint16_t pressure; // 14 bits
+    uint16_t temperature; // 11 bits, only read with ABP_TEMPERATURE
+};
+
+enum abp_status_e abp_read(struct abp_sample_t *sample);
+bool abp_request_pressure(void (*callback)(const struct abp_sample_t *sample));
+void abp_start_sampling(uint8_t trigger_generator, void (*callback)(const struct abp_sample_t *sample));
 
 #endif
 
@@ -1,6 +1,9 @@
 #include "atqt2120.h"
 #include "sercom.h"
 #include "config.h"
+#include "dmac.h"
+#include "evsys.h"
+#include "settings.h"
 
 #define SERCOMID SERCOM_KEYS_CHANNEL
 #define ATQT2120_I2C_ADDRESS 0x1c
@@ -13,6 +16,11 @@
 #define ADD_TTD 9
 #define ADD_DI 11
 #define ADD_DTHR0 16
+#define ADD_SIGNAL0 52
+#define ADD_REFERENCE0 76
+
+// Failed status reads queued again in a row, on top of the SERCOM retries
+#define STATUS_RETRIES 3
 
 /* const uint8_t *data format:
  *    data[0] = local address
@@ -25,13 +33,122 @@
  * uint8_t *data format:
  *    data[0...] = data0...
  * size_t length == length of data
+ * Single transaction, with a repeated START between address and data
  */
 #define i2c_read(address, data, length) do{\
     uint8_t _address = (address);\
-    i2c_write(&_address, 1);\
-    sercom_i2c_read(SERCOMID, ATQT2120_I2C_ADDRESS, (data), (length));\
+    sercom_i2c_write_read(SERCOMID, ATQT2120_I2C_ADDRESS, &_address, 1, (data), (length));\
 } while(0)
 
+/* Detection status block: detection status, key status (KEY0 to KEY7),
+ * key status (KEY8 to KEY11 in bits 3:0)
+ */
+static uint16_t keys(const uint8_t *status)
+{
+    return (status[1] | (status[2] << 8)) & ATQT2120_KEYS_MASK;
+}
+
+static struct
+{
+    struct sercom_i2c_transfer_t transfer;
+    uint8_t address;
+    uint8_t status[3];
+    void (*callback)(uint16_t keys);
+    bool again;
+    uint8_t retries; // See STATUS_RETRIES
+
+    // DMA reads
+    enum gpio_port_e change_port;
+    uint8_t change_pin;
+    volatile uint8_t dma_reads; // Completed, see atqt2120_check_dma_reads
+    uint8_t checked_reads;
+    bool change_was_low;
+    uint32_t addr_write;
+    uint32_t addr_read;
+    struct dmac_descriptor_t tx_addr_read;
+
+    // Signal frames: one is filled while the other one is published
+    struct sercom_i2c_transfer_t signal_transfer;
+    uint8_t signal_address;
+    struct atqt2120_signals_t frames[2];
+    volatile uint8_t published;
+    volatile bool signals_pending;
+    uint16_t signal_keys;
+    uint8_t step;
+    void (*signals_callback)(const struct atqt2120_signals_t *frame);
+} context;
+
+/* /CHANGE stays low until the status is read: a failed read, or a change
+ * signaled during the read, must be followed by another read. A device that
+ * keeps failing is given up on until the next request.
+ */
+static void on_status(struct sercom_i2c_transfer_t *transfer)
+{
+    bool ok = (transfer->status == SERCOM_I2C_DONE);
+    uint16_t new_keys = keys(context.status); // Before the buffer is reused
+    if(ok)
+        context.retries = 0;
+    else if(context.retries < STATUS_RETRIES)
+    {
+        ++context.retries;
+        context.again = true;
+    }
+    else
+        context.again = false; // Given up on
+
+    if(context.again)
+    {
+        context.again = false;
+        sercom_i2c_submit(SERCOMID, transfer);
+    }
+    if(ok)
+        context.callback(new_keys);
+}
+
+/* Queues the read of the next signal or reference of the frame being filled.
+ * Returns false once the frame is complete.
+ */
+static bool signal_step(void)
+{
+    while(context.step < 2 * NKEYS && !(context.signal_keys & (1u << (context.step / 2))))
+        ++context.step;
+    if(context.step == 2 * NKEYS)
+        return false;
+
+    struct atqt2120_signals_t *frame = &context.frames[!context.published];
+    uint8_t key = context.step / 2;
+    if(context.step & 1)
+    {
+        context.signal_address = ADD_REFERENCE0 + 2 * key;
+        context.signal_transfer.rx = (uint8_t*) &frame->reference[key];
+    }
+    else
+    {
+        context.signal_address = ADD_SIGNAL0 + 2 * key;
+        context.signal_transfer.rx = (uint8_t*) &frame->signal[key];
+    }
+    return sercom_i2c_submit(SERCOMID, &context.signal_transfer);
+}
+
+/* One short transaction per value, queued from the previous one: a status
+ * read queued meanwhile only waits for the value being read, never for the
+ * rest of the frame. A failed read drops the frame.
+ */
+static void on_signal(struct sercom_i2c_transfer_t *transfer)
+{
+    if(transfer->status == SERCOM_I2C_DONE)
+    {
+        ++context.step;
+        if(signal_step())
+            return;
+        context.published = !context.published;
+        context.signals_pending = false;
+        context.signals_callback(&context.frames[context.published]);
+    }
+    else
+        context.signals_pending = false;
+}
+
 void atqt2120_init(const struct atqt2120_t *config)
 {
     union key_u {
@@ -63,11 +180,13 @@ void atqt2120_init(const struct atqt2120_t *config)
     tmp[2] = 1; // ATD
     i2c_write(tmp, 3);
 
-    // 3. Configure keys
+    // 3. Configure keys, with the calibrated thresholds if any
+    const struct settings_t *settings = settings_get();
     tmp[0] = ADD_DTHR0;
     for(size_t i = 0; i < NKEYS; ++i)
     {
-        tmp[i+1        ] = config->keys[i].dthr;
+        bool calibrated = (settings && settings->key_dthr[i]);
+        tmp[i+1        ] = (calibrated ? settings->key_dthr[i] : config->keys[i].dthr);
         tmp[i+1 + NKEYS] = config->keys[i].ctrl.raw;
     }
     i2c_write(tmp, 2 * NKEYS + 1);
@@ -77,14 +196,241 @@ void atqt2120_init(const struct atqt2120_t *config)
     tmp[1] = 1;
     i2c_write(tmp, 2);
     
+    // Detection status read, for atqt2120_request_status
+    context.address = ADD_DETECTION_STATUS;
+    context.transfer.address = ATQT2120_I2C_ADDRESS;
+    context.transfer.tx = &context.address;
+    context.transfer.tx_size = 1;
+    context.transfer.rx = context.status;
+    context.transfer.rx_size = sizeof(context.status);
+    context.transfer.callback = on_status;
+    context.transfer.status = SERCOM_I2C_DONE;
+    context.again = false;
+    context.retries = 0;
+
+    // Signal reads, for atqt2120_request_signals
+    context.signal_transfer.address = ATQT2120_I2C_ADDRESS;
+    context.signal_transfer.tx = &context.signal_address;
+    context.signal_transfer.tx_size = 1;
+    context.signal_transfer.rx_size = 2;
+    context.signal_transfer.callback = on_signal;
+    context.signal_transfer.status = SERCOM_I2C_DONE;
+    context.published = 0;
+    context.signals_pending = false;
+
     // Now, enable interrupts on /CHANGE signal
     gpio_configure_function(config->change_port, config->change_pin, GPIO_FUNC_A);
+    gpio_enable_input(config->change_port, config->change_pin);
+    context.change_port = config->change_port;
+    context.change_pin = config->change_pin;
 }
 
-uint8_t atqt2120_read_status(void)
+uint16_t atqt2120_read_status(void)
 {
     uint8_t tmp[3];
     i2c_read(ADD_DETECTION_STATUS, tmp, 3);
-    return tmp[1];
+    return keys(tmp);
+}
+
+void atqt2120_set_thresholds(const uint8_t *dthr)
+{
+    uint8_t tmp[NKEYS + 1];
+    tmp[0] = ADD_DTHR0;
+    for(size_t i = 0; i < NKEYS; ++i)
+        tmp[i+1] = dthr[i];
+    i2c_write(tmp, NKEYS + 1);
+}
+
+// Blocking read of all the signals and references
+void atqt2120_read_signals(struct atqt2120_signals_t *frame)
+{
+    i2c_read(ADD_SIGNAL0, (uint8_t*) frame->signal, sizeof(frame->signal));
+    i2c_read(ADD_REFERENCE0, (uint8_t*) frame->reference, sizeof(frame->reference));
 }
 
+/* Non-blocking status read, callback is called from the SERCOM interrupt
+ * with the status of KEY0 to KEY11
+ */
+void atqt2120_request_status(void (*callback)(uint16_t keys))
+{
+    context.callback = callback;
+    if(!sercom_i2c_submit(SERCOMID, &context.transfer))
+        context.again = true; // Already queued
+    else
+        context.retries = 0; // Same priority as the SERCOM interrupt
+}
+
+/* DMAC interrupt: the status bytes are in RAM. /CHANGE still low means a
+ * change was signaled during the read: there is no new falling edge to
+ * trigger the next read, which is then started from here.
+ */
+static void on_dma_status(uint8_t channel)
+{
+    (void) channel;
+    uint16_t new_keys = keys(context.status); // Before the buffer is reused
+    ++context.dma_reads;
+    if(!gpio_read(context.change_port, context.change_pin))
+        dmac_trigger(DMAC_KEYS_START_CHANNEL);
+    context.callback(new_keys);
+}
+
+static void on_dma_error(uint8_t channel);
+
+// Channels start over from their first descriptor
+static void dma_arm(void)
+{
+    volatile void *addr = sercom_i2c_addr_register(SERCOMID);
+    volatile void *data = sercom_i2c_data_register(SERCOMID);
+
+    struct dmac_descriptor_t *start = dmac_descriptor(DMAC_KEYS_START_CHANNEL);
+    dmac_describe(start, DMAC_BTCTRL_BEATSIZE_WORD, &context.addr_write, addr, 1, start);
+
+    struct dmac_descriptor_t *tx = dmac_descriptor(DMAC_KEYS_TX_CHANNEL);
+    dmac_describe(tx, DMAC_BTCTRL_BEATSIZE_BYTE, &context.address, data, 1, &context.tx_addr_read);
+    dmac_describe(&context.tx_addr_read, DMAC_BTCTRL_BEATSIZE_WORD, &context.addr_read, addr, 1, tx);
+
+    struct dmac_descriptor_t *rx = dmac_descriptor(DMAC_KEYS_RX_CHANNEL);
+    dmac_describe(rx, DMAC_BTCTRL_BEATSIZE_BYTE | DMAC_BTCTRL_DSTINC | DMAC_BTCTRL_BLOCKACT_INT, data, context.status, sizeof(context.status), rx);
+
+    dmac_configure_channel(DMAC_KEYS_RX_CHANNEL, DMAC_TRIGGER_SERCOM_RX(SERCOMID), DMAC_TRIGACT_BEAT, DMAC_EVACT_NONE, false);
+    dmac_configure_channel(DMAC_KEYS_TX_CHANNEL, DMAC_TRIGGER_SERCOM_TX(SERCOMID), DMAC_TRIGACT_BEAT, DMAC_EVACT_NONE, false);
+    dmac_configure_channel(DMAC_KEYS_START_CHANNEL, DMAC_TRIGGER_NONE, DMAC_TRIGACT_BLOCK, DMAC_EVACT_TRIG, false);
+    dmac_enable_channel(DMAC_KEYS_RX_CHANNEL, on_dma_status);
+    dmac_enable_channel(DMAC_KEYS_TX_CHANNEL, NULL);
+    dmac_enable_channel(DMAC_KEYS_START_CHANNEL, NULL);
+    dmac_set_error_callback(DMAC_KEYS_RX_CHANNEL, on_dma_error);
+    dmac_set_error_callback(DMAC_KEYS_TX_CHANNEL, on_dma_error);
+    dmac_set_error_callback(DMAC_KEYS_START_CHANNEL, on_dma_error);
+}
+
+/* Aborts the transaction in progress, clears the bus and starts the chain
+ * over. A change signaled meanwhile is read right away, its falling edge
+ * being gone.
+ */
+static void dma_recover(void)
+{
+    dmac_disable_channel(DMAC_KEYS_START_CHANNEL);
+    dmac_disable_channel(DMAC_KEYS_TX_CHANNEL);
+    dmac_disable_channel(DMAC_KEYS_RX_CHANNEL);
+    sercom_i2c_abort(SERCOMID);
+
+    dma_arm();
+    if(!gpio_read(context.change_port, context.change_pin))
+        dmac_trigger(DMAC_KEYS_START_CHANNEL);
+}
+
+// SERCOM ERROR (bus error, lost arbitration, timeouts) or DMAC TERR
+static void on_dma_error(uint8_t channel)
+{
+    (void) channel;
+    dma_recover();
+}
+
+/*
+ * Each trigger event (the /CHANGE falling edge) reads the status without
+ * the CPU, in a single transaction:
+ *     start channel (triggered by the event):
+ *         ADDR <- write address (START)
+ *         (or by on_dma_status, when /CHANGE is still low after a read)
+ *     TX channel (paced by MB):
+ *         DATA <- ADD_DETECTION_STATUS
+ *         ADDR <- read address, LENEN, 3 bytes (repeated START)
+ *     RX channel (paced by SB):
+ *         DATA -> status (NACK and STOP after the last byte)
+ * The CPU is only interrupted once the status is in RAM, callback is then
+ * called from the DMAC interrupt with the status of KEY0 to KEY11.
+ * Bus errors and DMAC transfer errors abort the transaction and start the
+ * chain over. A NACK is no bus error: atqt2120_check_dma_reads catches the
+ * reads that never complete. The I2C queue must not be used on this SERCOM
+ * anymore.
+ */
+void atqt2120_start_dma_reads(uint8_t trigger_generator, void (*callback)(uint16_t keys))
+{
+    context.callback = callback;
+    context.address = ADD_DETECTION_STATUS;
+    context.addr_write = (ATQT2120_I2C_ADDRESS << 1);
+    context.addr_read = SERCOM_I2C_ADDR(ATQT2120_I2C_ADDRESS, true, sizeof(context.status));
+    context.dma_reads = 0;
+    context.checked_reads = 0;
+    context.change_was_low = false;
+    sercom_i2c_set_dma_mode(SERCOMID, on_dma_error);
+
+    dma_arm();
+    evsys_connect(EVSYS_KEYS_CHANNEL, trigger_generator, EVSYS_USER_DMAC_CH(DMAC_KEYS_START_CHANNEL));
+}
+
+/* To be called periodically, at the DMAC interrupt priority, once the DMA
+ * reads are started, much less often than a read lasts (150us at 400kHz).
+ * /CHANGE low at two calls in a row with no read completed in between means
+ * the chain is stuck (e.g. a NACK), which is then started over.
+ */
+void atqt2120_check_dma_reads(void)
+{
+    bool low = !gpio_read(context.change_port, context.change_pin);
+    uint8_t reads = context.dma_reads;
+    if(low && context.change_was_low && reads == context.checked_reads)
+    {
+        dma_recover();
+        low = false; // Give the new read a full period
+    }
+    context.change_was_low = low;
+    context.checked_reads = reads;
+}
+
+/* Non-blocking read of the signal and reference of each key of keys (KEY0 in
+ * bit 0), callback is called from the SERCOM interrupt with the new frame.
+ * Returns false if the previous frame is not complete yet.
+ * Not available once the DMA reads are started.
+ */
+bool atqt2120_request_signals(uint16_t keys, void (*callback)(const struct atqt2120_signals_t *frame))
+{
+    if(context.signals_pending)
+        return false;
+
+    context.signals_pending = true;
+    context.signals_callback = callback;
+    context.signal_keys = keys & ATQT2120_KEYS_MASK;
+    context.step = 0;
+    if(!signal_step())
+    {
+        context.signals_pending = false;
+        return false;
+    }
+    return true;
+}
+
+// Last complete frame
+const struct atqt2120_signals_t *atqt2120_signals(void)
+{
+    return &context.frames[context.published];
+}
+
+// Signal drop below the reference, as a finger gets closer (0 if above)
+uint16_t atqt2120_delta(const struct atqt2120_signals_t *frame, uint8_t key)
+{
+    key %= NKEYS;
+    if(frame->signal[key] >= frame->reference[key])
+        return 0;
+    return frame->reference[key] - frame->signal[key];
+}
+
+/* full_delta: signal drop of a fully covered key. The division is done here,
+ * once, so that atqt2120_coverage only multiplies and shifts.
+ */
+void atqt2120_coverage_init(struct atqt2120_coverage_t *coverage, uint16_t full_delta)
+{
+    if(!full_delta)
+        full_delta = 1;
+    coverage->full_delta = full_delta;
+    coverage->scale = ((uint32_t) ATQT2120_COVERAGE_FULL << ATQT2120_COVERAGE_SHIFT) / full_delta;
+}
+
+// 0 (untouched) to ATQT2120_COVERAGE_FULL
+uint8_t atqt2120_coverage(const struct atqt2120_signals_t *frame, uint8_t key, const struct atqt2120_coverage_t *coverage)
+{
+    uint32_t delta = atqt2120_delta(frame, key);
+    if(delta >= coverage->full_delta)
+        return ATQT2120_COVERAGE_FULL;
+    // delta < full_delta: the product stays below ATQT2120_COVERAGE_FULL << ATQT2120_COVERAGE_SHIFT
+    return (delta * coverage->scale) >> ATQT2120_COVERAGE_SHIFT;
+}
@@ -2,6 +2,7 @@
 #define ATQT2120_h
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "gpio.h"
 
 struct __attribute__((packed)) atqt2120_key_t
@@ -31,7 +32,38 @@ struct atqt2120_t
 
 void atqt2120_init(const struct atqt2120_t *config);
 
-// Only returns the status of KEY0 to KEY7
-uint8_t atqt2120_read_status(void);
+// Status of KEY0 (bit 0) to KEY11 (bit 11), from a single read
+#define ATQT2120_KEYS_MASK 0x0fff
+
+uint16_t atqt2120_read_status(void);
+void atqt2120_set_thresholds(const uint8_t *dthr);
+void atqt2120_request_status(void (*callback)(uint16_t keys));
+void atqt2120_start_dma_reads(uint8_t trigger_generator, void (*callback)(uint16_t keys));
+void atqt2120_check_dma_reads(void);
+
+// Raw key signals, LSB first like the registers
+struct atqt2120_signals_t
+{
+    uint16_t signal[12];
+    uint16_t reference[12];
+};
+
+// Coverage of a fully covered key
+#define ATQT2120_COVERAGE_FULL 255
+#define ATQT2120_COVERAGE_SHIFT 16
+
+// Per key, see atqt2120_coverage_init
+struct atqt2120_coverage_t
+{
+    uint16_t full_delta;
+    uint32_t scale; // ATQT2120_COVERAGE_FULL / full_delta, in steps of 2^-ATQT2120_COVERAGE_SHIFT
+};
+
+void atqt2120_read_signals(struct atqt2120_signals_t *frame);
+bool atqt2120_request_signals(uint16_t keys, void (*callback)(const struct atqt2120_signals_t *frame));
+const struct atqt2120_signals_t *atqt2120_signals(void);
+uint16_t atqt2120_delta(const struct atqt2120_signals_t *frame, uint8_t key);
+void atqt2120_coverage_init(struct atqt2120_coverage_t *coverage, uint16_t full_delta);
+uint8_t atqt2120_coverage(const struct atqt2120_signals_t *frame, uint8_t key, const struct atqt2120_coverage_t *coverage);
 
 #endif
@@ -0,0 +1,146 @@
+#include "breath.h"
+#include "usb_midi.h"
+#include "midi.h"
+#include "gclk.h"
+#include "systick.h"
+
+#define SEGMENTS_SHIFT 5
+#define SEGMENTS (1 << SEGMENTS_SHIFT)
+#define INDEX_FRACTION_BITS 16
+
+// Response curves, SEGMENTS + 1 points from pressure_min to pressure_max
+static const uint16_t curves[BREATH_N_CURVES][SEGMENTS + 1] = {
+    [BREATH_CURVE_LINEAR] = {
+        0, 512, 1024, 1536, 2048, 2560, 3072, 3584, 4096, 4608, 5120,
+        5632, 6144, 6656, 7168, 7680, 8192, 8703, 9215, 9727, 10239, 10751,
+        11263, 11775, 12287, 12799, 13311, 13823, 14335, 14847, 15359, 15871, 16383
+    },
+    [BREATH_CURVE_SOFT] = { // sqrt: more resolution for soft passages
+        0, 2896, 4096, 5016, 5792, 6476, 7094, 7662, 8192, 8688, 9158,
+        9605, 10032, 10442, 10836, 11217, 11585, 11941, 12287, 12624, 12952, 13272,
+        13584, 13889, 14188, 14481, 14767, 15049, 15325, 15596, 15863, 16125, 16383
+    },
+    [BREATH_CURVE_HARD] = { // Square
+        0, 16, 64, 144, 256, 400, 576, 784, 1024, 1296, 1600,
+        1936, 2304, 2704, 3136, 3600, 4096, 4624, 5184, 5776, 6400, 7056,
+        7744, 8463, 9215, 9999, 10815, 11663, 12543, 13455, 14399, 15375, 16383
+    }
+};
+
+static struct
+{
+    struct breath_config_t config;
+    uint32_t scale; // Counts above pressure_min to table index, in INDEX_FRACTION_BITS fixed point
+    uint32_t min_interval; // CPU cycles
+    uint16_t sent;
+    bool any_sent;
+    uint32_t last_time;
+} context;
+
+// The only divisions happen here, not per sample
+bool breath_init(const struct breath_config_t *config)
+{
+    if(config->pressure_max <= config->pressure_min || !config->max_rate_hz || config->curve >= BREATH_N_CURVES)
+        return false;
+
+    // The interval is timed with SysTick, and must be shorter than its period
+    uint32_t min_interval = gclk_get_frequency(GCLK0) / config->max_rate_hz;
+    if(min_interval >= SYSTICK_MASK)
+        return false;
+
+    context.config = *config;
+    context.scale = ((uint32_t) SEGMENTS << INDEX_FRACTION_BITS) / (config->pressure_max - config->pressure_min);
+    context.min_interval = min_interval;
+    context.any_sent = false;
+    return true;
+}
+
+void breath_set_output(enum breath_output_e output)
+{
+    context.config.output = output;
+    context.any_sent = false;
+}
+
+void breath_set_curve(enum breath_curve_e curve)
+{
+    if(curve < BREATH_N_CURVES)
+        context.config.curve = curve;
+}
+
+// Table lookup with linear interpolation between the two nearest points
+uint16_t breath_value(uint16_t pressure)
+{
+    if(pressure <= context.config.pressure_min)
+        return 0;
+    if(pressure >= context.config.pressure_max)
+        return BREATH_VALUE_MAX;
+
+    uint32_t index = (pressure - context.config.pressure_min) * context.scale;
+    uint32_t segment = index >> INDEX_FRACTION_BITS;
+    if(segment >= SEGMENTS)
+        return BREATH_VALUE_MAX;
+    uint32_t fraction = (index >> (INDEX_FRACTION_BITS - 8)) & 0xff;
+    const uint16_t *curve = curves[context.config.curve];
+    return curve[segment] + (((curve[segment + 1] - curve[segment]) * fraction) >> 8);
+}
+
+static bool send_cc(uint8_t controller, uint16_t value)
+{
+    uint8_t channel = context.config.channel;
+    if(context.config.high_resolution)
+        return usb_midi_control_change_14bit(channel, controller, value);
+    return usb_midi_control_change(channel, controller, value >> 7);
+}
+
+static bool send(uint16_t value)
+{
+    uint8_t channel = context.config.channel;
+    uint8_t value7 = (value >> 7);
+    switch(context.config.output)
+    {
+        case BREATH_OUTPUT_CC2:
+            return send_cc(MIDI_CTRL_BREATH_MSB, value);
+        case BREATH_OUTPUT_CC11:
+            return send_cc(MIDI_CTRL_EXPRESSION_MSB, value);
+        case BREATH_OUTPUT_CHANNEL_PRESSURE:
+            return usb_midi_channel_pressure(channel, value7);
+        default:
+            return true;
+    }
+}
+
+/* Called with every filtered pressure value: a message is only sent when
+ * the value left the deadband around the last one sent, and no sooner than
+ * 1/max_rate_hz after it. Values that are held back are sent by a later
+ * call, as the pressure keeps being sampled.
+ */
+void breath_update(uint16_t pressure)
+{
+    if(context.config.output == BREATH_OUTPUT_NONE)
+        return;
+
+    uint16_t value = breath_value(pressure);
+    uint32_t now = systick_now();
+    // SysTick wraps within a second: last_time must not age past min_interval
+    systick_saturate(context.last_time, now, context.min_interval);
+    if(context.any_sent)
+    {
+        uint16_t change = (value > context.sent ? value - context.sent : context.sent - value);
+        // The ends of the range are always reached, whatever the deadband
+        bool end = (value != context.sent && (value == 0 || value == BREATH_VALUE_MAX));
+        if(change <= context.config.deadband && !end)
+            return;
+        if(systick_elapsed(context.last_time, now) < context.min_interval)
+            return;
+    }
+    bool high_resolution = context.config.high_resolution && context.config.output != BREATH_OUTPUT_CHANNEL_PRESSURE;
+    if(!high_resolution && (value >> 7) == (context.sent >> 7) && context.any_sent)
+        return; // Same 7-bit message
+    if(send(value))
+    {
+        context.sent = value;
+        context.any_sent = true;
+        context.last_time = now;
+    }
+}
+
@@ -0,0 +1,45 @@
+#ifndef BREATH_H
+#define BREATH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// 14-bit breath values, 0 to BREATH_VALUE_MAX
+#define BREATH_VALUE_MAX 0x3fff
+
+enum breath_output_e
+{
+    BREATH_OUTPUT_NONE,
+    BREATH_OUTPUT_CC2, // Breath controller
+    BREATH_OUTPUT_CC11, // Expression
+    BREATH_OUTPUT_CHANNEL_PRESSURE
+};
+
+enum breath_curve_e
+{
+    BREATH_CURVE_LINEAR,
+    BREATH_CURVE_SOFT,
+    BREATH_CURVE_HARD,
+    BREATH_N_CURVES
+};
+
+struct breath_config_t
+{
+    enum breath_output_e output;
+    bool high_resolution; // CCs as 14-bit MSB/LSB pairs (not channel pressure)
+    uint8_t channel;
+    enum breath_curve_e curve;
+    uint16_t pressure_min; // Counts, value 0 below
+    uint16_t pressure_max; // Counts, BREATH_VALUE_MAX above
+    uint16_t deadband; // In 14-bit units around the last value sent
+    uint16_t max_rate_hz; // Messages per second, above CPU clock / 2^24 (at least 3 at 48 MHz)
+};
+
+bool breath_init(const struct breath_config_t *config);
+void breath_set_output(enum breath_output_e output);
+void breath_set_curve(enum breath_curve_e curve);
+uint16_t breath_value(uint16_t pressure);
+void breath_update(uint16_t pressure);
+
+#endif
+
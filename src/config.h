@@ -6,5 +6,61 @@
 #define SERCOM_PRESSURE_CHANNEL 0
 #define SERCOM_KEYS_CHANNEL 4
 
+// 1: USB-MIDI events are sent right after each start-of-frame
+#define USB_MIDI_SOF_SYNC 0
+
+// 1: the ABP frames include the temperature (4 bytes instead of 2)
+#define ABP_TEMPERATURE 0
+
+/* 1: pressure sampling without the CPU: TC3 overflow -> EVSYS -> DMAC (SPI) -> RAM
+ *    The DMA owns SERCOM0 then, no other SPI transfer can be queued on it
+ * 0: TC3 interrupt queuing asynchronous SPI transfers (shares SERCOM0)
+ */
+#define PRESSURE_SAMPLING_DMA 0
+// Only DMAC channels 0 to 3 can use events
+#define DMAC_PRESSURE_TX_CHANNEL 0
+#define DMAC_PRESSURE_RX_CHANNEL 1
+#define DMAC_PRESSURE_CE_CHANNEL 2
+#define EVSYS_PRESSURE_START_CHANNEL 0
+#define EVSYS_PRESSURE_END_CHANNEL 1
+// Pressure samples per interrupt, must divide ABP_RING_FRAMES
+#define PRESSURE_SAMPLES_PER_INTERRUPT 1
+
+/* Pressure filter between the sensor and the note logic (see filter.h):
+ * 2^n samples summed, IIR (1) or moving average (0) over 2^n values, and
+ * one control value every PRESSURE_DECIMATION of them. Shifts are 0 to 4
+ */
+#define PRESSURE_OVERSAMPLING_SHIFT 1
+#define PRESSURE_FILTER_IIR 1
+#define PRESSURE_SMOOTHING_SHIFT 2
+#define PRESSURE_DECIMATION 1
+
+/* Note on velocity from the pressure rise over the last VELOCITY_LOOKBACK
+ * filtered values before the breath threshold (power of two). The note is
+ * never delayed: only past values are used
+ */
+#define VELOCITY_LOOKBACK 8
+
+/* 1: key status read by DMA on /CHANGE (EIC event), started over on bus
+ * errors and stuck reads (see atqt2120_check_dma_reads)
+ * 0: EIC interrupt queuing an I2C read, needed by KEYS_SIGNAL_STREAMING
+ */
+#define KEYS_READ_DMA 0
+#define DMAC_KEYS_START_CHANNEL 3 // Triggered by an event
+#define DMAC_KEYS_TX_CHANNEL 4
+#define DMAC_KEYS_RX_CHANNEL 5
+#define EVSYS_KEYS_CHANNEL 2
+
+// Pitch wheel range of the receiver, in semitones (General MIDI default)
+#define PITCH_BEND_RANGE 2
+
+/* 1: the signals of the chanter keys are also read, paced by TC4, for
+ * half-holing. Needs KEYS_READ_DMA 0: the DMA reads own SERCOM4, and no
+ * signal read can be queued in between. Half-holing is not available with
+ * the DMA key reads.
+ */
+#define KEYS_SIGNAL_STREAMING 1
+#define KEYS_SIGNAL_HZ 200 // As slow as the 8-bit TC4 goes from the 48MHz clock
+
 #endif
 
@@ -0,0 +1,185 @@
+#include "dmac.h"
+
+struct __attribute__((packed)) dmac_t
+{
+    uint16_t ctrl;
+    uint16_t crcctrl;
+    uint32_t crcdatain;
+    uint32_t crcchksum;
+    uint8_t crcstatus;
+    uint8_t dbgctrl;
+    uint8_t qosctrl;
+    uint8_t _pad0;
+    uint32_t swtrigctrl;
+    uint32_t prictrl0;
+    uint32_t _pad1[2];
+    uint16_t intpend;
+    uint16_t _pad2;
+    uint32_t intstatus;
+    uint32_t busych;
+    uint32_t pendch;
+    uint32_t active;
+    uint32_t baseaddr;
+    uint32_t wrbaddr;
+    uint8_t _pad3[3];
+    uint8_t chid;
+    uint8_t chctrla;
+    uint8_t _pad4[3];
+    uint32_t chctrlb;
+    uint32_t _pad5;
+    uint8_t chintenclr;
+    uint8_t chintenset;
+    uint8_t chintflag;
+    uint8_t chstatus;
+};
+
+#define DMAC ((volatile struct dmac_t*) 0x41004800)
+
+#define CTRL_SWRST     (1 << 0)
+#define CTRL_DMAENABLE (1 << 1)
+#define CTRL_LVLEN_ALL (0xf << 8)
+
+#define CHCTRLA_SWRST  (1 << 0)
+#define CHCTRLA_ENABLE (1 << 1)
+
+#define CHINT_TERR  (1 << 0)
+#define CHINT_TCMPL (1 << 1)
+#define CHINT_SUSP  (1 << 2)
+
+#define BTCTRL_VALID (1 << 0)
+
+/* 20.6.2: first descriptor of every channel, and the write-back copy of the
+ * descriptor each channel is currently working on
+ */
+static struct dmac_descriptor_t descriptors[DMAC_N_CHANNELS];
+static struct dmac_descriptor_t writeback[DMAC_N_CHANNELS];
+
+static struct
+{
+    void (*callbacks[DMAC_N_CHANNELS])(uint8_t channel);
+    void (*error_callbacks[DMAC_N_CHANNELS])(uint8_t channel);
+} context;
+
+/*
+ * CLK_DMAC_AHB and CLK_DMAC_APB are enabled on reset (Table 16-1)
+ */
+void dmac_init(void)
+{
+    DMAC->ctrl = 0; // Disable
+    DMAC->ctrl = CTRL_SWRST;
+    while(DMAC->ctrl & CTRL_SWRST);
+
+    DMAC->baseaddr = (uint32_t) descriptors;
+    DMAC->wrbaddr = (uint32_t) writeback;
+    DMAC->ctrl = CTRL_DMAENABLE | CTRL_LVLEN_ALL;
+
+    for(size_t i = 0; i < DMAC_N_CHANNELS; ++i)
+    {
+        context.callbacks[i] = NULL;
+        context.error_callbacks[i] = NULL;
+    }
+}
+
+struct dmac_descriptor_t *dmac_descriptor(uint8_t channel)
+{
+    return &descriptors[channel % DMAC_N_CHANNELS];
+}
+
+void dmac_describe(struct dmac_descriptor_t *descriptor, uint16_t btctrl, const volatile void *src, volatile void *dst, uint16_t beats, const struct dmac_descriptor_t *next)
+{
+    // Incremented addresses point right after the last beat
+    size_t length = ((size_t) beats << ((btctrl >> 8) & 0x3));
+
+    descriptor->btctrl = btctrl | BTCTRL_VALID;
+    descriptor->btcnt = beats;
+    descriptor->srcaddr = (uint32_t) src + ((btctrl & DMAC_BTCTRL_SRCINC) ? length : 0);
+    descriptor->dstaddr = (uint32_t) dst + ((btctrl & DMAC_BTCTRL_DSTINC) ? length : 0);
+    descriptor->descaddr = (uint32_t) next;
+}
+
+void dmac_configure_channel(uint8_t channel, uint8_t trigger, enum dmac_trigact_e trigact, enum dmac_evact_e evact, bool event_output)
+{
+    channel %= DMAC_N_CHANNELS;
+
+    DMAC->chid = channel;
+    DMAC->chctrla = 0; // Disable
+    while(DMAC->chctrla & CHCTRLA_ENABLE);
+    DMAC->chctrla = CHCTRLA_SWRST;
+    while(DMAC->chctrla & CHCTRLA_SWRST);
+
+    DMAC->chctrlb = evact
+                  | ((evact != DMAC_EVACT_NONE) << 3) // EVIE
+                  | (event_output << 4) // EVOE
+                  | (0x0 << 5) // LVL (lowest priority)
+                  | ((trigger & 0x3f) << 8)
+                  | (trigact << 22)
+                  ;
+}
+
+/* The callback is called from the DMAC interrupt whenever a block that has
+ * DMAC_BTCTRL_BLOCKACT_INT is complete
+ */
+void dmac_enable_channel(uint8_t channel, void (*callback)(uint8_t channel))
+{
+    channel %= DMAC_N_CHANNELS;
+    context.callbacks[channel] = callback;
+
+    DMAC->chid = channel;
+    DMAC->chintflag = CHINT_TERR | CHINT_TCMPL | CHINT_SUSP;
+    if(callback)
+        DMAC->chintenset = CHINT_TCMPL;
+    DMAC->chctrla = CHCTRLA_ENABLE;
+}
+
+/* The callback is called from the DMAC interrupt on a transfer error (bus
+ * error or invalid descriptor), the channel is then disabled by the hardware
+ */
+void dmac_set_error_callback(uint8_t channel, void (*callback)(uint8_t channel))
+{
+    channel %= DMAC_N_CHANNELS;
+    context.error_callbacks[channel] = callback;
+
+    DMAC->chid = channel;
+    if(callback)
+        DMAC->chintenset = CHINT_TERR;
+    else
+        DMAC->chintenclr = CHINT_TERR;
+}
+
+void dmac_disable_channel(uint8_t channel)
+{
+    channel %= DMAC_N_CHANNELS;
+
+    DMAC->chid = channel;
+    DMAC->chintenclr = CHINT_TERR | CHINT_TCMPL | CHINT_SUSP;
+    DMAC->chctrla = 0;
+    while(DMAC->chctrla & CHCTRLA_ENABLE);
+    context.callbacks[channel] = NULL;
+    context.error_callbacks[channel] = NULL;
+}
+
+// Starts a transfer of the channel as its trigger or event would (SWTRIGCTRL)
+void dmac_trigger(uint8_t channel)
+{
+    channel %= DMAC_N_CHANNELS;
+    DMAC->swtrigctrl = (1u << channel);
+}
+
+void dmac_handler(void)
+{
+    uint32_t status = DMAC->intstatus;
+    for(uint8_t channel = 0; channel < DMAC_N_CHANNELS; ++channel)
+    {
+        if(!(status & (1u << channel)))
+            continue;
+
+        DMAC->chid = channel;
+        uint8_t flags = DMAC->chintflag;
+        DMAC->chintflag = flags;
+        if((flags & CHINT_TCMPL) && context.callbacks[channel])
+            context.callbacks[channel](channel);
+        if((flags & CHINT_TERR) && context.error_callbacks[channel])
+            context.error_callbacks[channel](channel);
+    }
+}
+
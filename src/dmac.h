@@ -0,0 +1,65 @@
+#ifndef DMAC_H
+#define DMAC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Only channels 0 to 3 are EVSYS users and generators (Tables 24-6, 24-7)
+#define DMAC_N_CHANNELS 6
+
+// 20.10: the descriptors must be 128-bit aligned
+struct __attribute__((packed, aligned(16))) dmac_descriptor_t
+{
+    uint16_t btctrl;
+    uint16_t btcnt;
+    uint32_t srcaddr; // End address when SRCINC is set
+    uint32_t dstaddr; // End address when DSTINC is set
+    uint32_t descaddr;
+};
+
+// 20.10.1 BTCTRL (VALID is set by dmac_describe)
+#define DMAC_BTCTRL_EVOSEL_BLOCK   (0x1 << 1)
+#define DMAC_BTCTRL_EVOSEL_BEAT    (0x3 << 1)
+#define DMAC_BTCTRL_BLOCKACT_INT   (0x1 << 3)
+#define DMAC_BTCTRL_BLOCKACT_SUSPEND (0x2 << 3)
+#define DMAC_BTCTRL_BEATSIZE_BYTE  (0x0 << 8)
+#define DMAC_BTCTRL_BEATSIZE_HWORD (0x1 << 8)
+#define DMAC_BTCTRL_BEATSIZE_WORD  (0x2 << 8)
+#define DMAC_BTCTRL_SRCINC         (1 << 10)
+#define DMAC_BTCTRL_DSTINC         (1 << 11)
+
+// CHCTRLB.TRIGSRC
+#define DMAC_TRIGGER_NONE 0 // Software or event only
+#define DMAC_TRIGGER_SERCOM_RX(x) (0x01 + ((x) << 1))
+#define DMAC_TRIGGER_SERCOM_TX(x) (0x02 + ((x) << 1))
+
+enum dmac_trigact_e
+{
+    DMAC_TRIGACT_BLOCK = 0,
+    DMAC_TRIGACT_BEAT = 2,
+    DMAC_TRIGACT_TRANSACTION
+};
+
+enum dmac_evact_e
+{
+    DMAC_EVACT_NONE = 0,
+    DMAC_EVACT_TRIG,
+    DMAC_EVACT_CTRIG,
+    DMAC_EVACT_CBLOCK,
+    DMAC_EVACT_SUSPEND,
+    DMAC_EVACT_RESUME,
+    DMAC_EVACT_SSKIP
+};
+
+void dmac_init(void);
+struct dmac_descriptor_t *dmac_descriptor(uint8_t channel);
+void dmac_describe(struct dmac_descriptor_t *descriptor, uint16_t btctrl, const volatile void *src, volatile void *dst, uint16_t beats, const struct dmac_descriptor_t *next);
+void dmac_configure_channel(uint8_t channel, uint8_t trigger, enum dmac_trigact_e trigact, enum dmac_evact_e evact, bool event_output);
+void dmac_enable_channel(uint8_t channel, void (*callback)(uint8_t channel));
+void dmac_set_error_callback(uint8_t channel, void (*callback)(uint8_t channel));
+void dmac_disable_channel(uint8_t channel);
+void dmac_trigger(uint8_t channel);
+
+#endif
+
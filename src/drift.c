@@ -0,0 +1,61 @@
+#include <stddef.h>
+
+#include "drift.h"
+#include "abp-spi.h"
+#include "config.h"
+
+// Constant expressions, folded at compile time (the divider is in software)
+#define PA_PER_COUNT_Q8 ((int32_t) (((ABP_90_PERCENT_PA - ABP_10_PERCENT_PA) << 8) / (ABP_COUNT_MAX - ABP_COUNT_MIN)))
+#define WHEEL_PER_CENT_PA_Q16 ((0x2000 << 16) / (100 * PITCH_BEND_RANGE * 1000))
+
+#define OFFSET_MAX 0x1fff
+
+// Offsets at the bounds of each step
+static int16_t curves[12][DRIFT_STEPS + 1];
+static uint16_t minimum_pressure;
+
+/* cents_per_kpa: how sharp each note gets per kPa above reference (counts),
+ * and flat below it. minimum: start of the playing range (counts). Only
+ * multiplies and shifts, so that it can also be called again at runtime to
+ * retune.
+ */
+void drift_init(const int8_t *cents_per_kpa, uint16_t minimum, uint16_t reference)
+{
+    minimum_pressure = minimum;
+    for(size_t step = 0; step <= DRIFT_STEPS; ++step)
+    {
+        int32_t counts = (int32_t) minimum + (int32_t) (step << DRIFT_SHIFT);
+        int32_t pa = ((counts - reference) * PA_PER_COUNT_Q8) >> 8;
+        int32_t wheel_per_cent_q8 = (pa * WHEEL_PER_CENT_PA_Q16) >> 8;
+
+        for(size_t note = 0; note < 12; ++note)
+        {
+            int32_t offset = (wheel_per_cent_q8 * cents_per_kpa[note]) >> 8;
+            if(offset > OFFSET_MAX)
+                offset = OFFSET_MAX;
+            else if(offset < -OFFSET_MAX)
+                offset = -OFFSET_MAX;
+            curves[note][step] = offset;
+        }
+    }
+}
+
+const int16_t *drift_curve(uint8_t note)
+{
+    return curves[note % 12];
+}
+
+
+// Per sample: an index and a linear interpolation (one multiply, one shift)
+int16_t drift_offset(const int16_t *curve, uint16_t pressure)
+{
+    if(pressure <= minimum_pressure)
+        return curve[0];
+    uint32_t position = pressure - minimum_pressure;
+    uint32_t step = (position >> DRIFT_SHIFT);
+    if(step >= DRIFT_STEPS)
+        return curve[DRIFT_STEPS];
+
+    int32_t fraction = position & ((1 << DRIFT_SHIFT) - 1);
+    return curve[step] + (((curve[step + 1] - curve[step]) * fraction) >> DRIFT_SHIFT);
+}
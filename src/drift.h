@@ -0,0 +1,19 @@
+#ifndef DRIFT_H
+#define DRIFT_H
+
+#include <stdint.h>
+
+/* Pitch drift with the breath pressure: one curve per note (C to B), of
+ * pitch wheel offsets over the playing range, from the minimum pressure on
+ * in steps of 2^DRIFT_SHIFT counts (about 0.2 kPa). Offsets in between are
+ * interpolated, past the range they are held.
+ */
+#define DRIFT_SHIFT 5
+#define DRIFT_STEPS 32 // About 6.4 kPa above the minimum
+
+void drift_init(const int8_t *cents_per_kpa, uint16_t minimum, uint16_t reference);
+const int16_t *drift_curve(uint8_t note);
+int16_t drift_offset(const int16_t *curve, uint16_t pressure);
+
+#endif
+
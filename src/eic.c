@@ -47,6 +47,19 @@ void eic_disable(uint8_t id)
     EIC->intenclr = (1u << id);
 }
 
+// Event output to the EVSYS, e.g. to start a DMA transfer
+void eic_enable_event(uint8_t id)
+{
+    id %= 18;
+
+    // Only written while the EIC is disabled
+    EIC->ctrl = 0;
+    while(EIC->status & (1 << 7)); // SYNCBUSY
+    EIC->evctrl |= (1u << id); // EXTINTEO
+    EIC->ctrl = (1 << 1); // ENABLE
+    while(EIC->status & (1 << 7)); // SYNCBUSY
+}
+
 void eic_clear(uint8_t id)
 {
     EIC->intflag = (1u << id);
@@ -6,6 +6,7 @@
 void eic_init(void);
 void eic_enable(uint8_t id);
 void eic_disable(uint8_t id);
+void eic_enable_event(uint8_t id);
 void eic_clear(uint8_t id);
 
 #endif
@@ -0,0 +1,48 @@
+#include "evsys.h"
+#include "gclk.h"
+
+struct __attribute__((packed)) evsys_t
+{
+    uint8_t ctrl;
+    uint8_t _pad0[3];
+    uint32_t channel;
+    uint16_t user;
+    uint16_t _pad1;
+    uint32_t chstatus;
+    uint32_t intenclr;
+    uint32_t intenset;
+    uint32_t intflag;
+};
+
+#define EVSYS ((volatile struct evsys_t*) 0x42000400)
+#define N_CHANNELS 12
+
+#define CTRL_SWRST (1 << 0)
+
+// CLK_EVSYS_APB must be enabled first (PM_CLK_EVSYS)
+void evsys_init(void)
+{
+    EVSYS->ctrl = CTRL_SWRST;
+    while(EVSYS->ctrl & CTRL_SWRST);
+}
+
+/* Resynchronized path, so that the event also reaches users that run from
+ * another clock domain: the channel gets its own GCLK0 connection
+ */
+void evsys_connect(uint8_t channel, uint8_t generator, uint8_t user)
+{
+    channel %= N_CHANNELS;
+
+    gclk_connect_clock(GCLK_DST_EVSYS_CHANNEL_0 + channel, 0);
+
+    // 24.6.2: the user has to be configured before the channel
+    EVSYS->user = (user & 0x1f)
+                | ((channel + 1) << 8) // CHANNEL (0 = none)
+                ;
+    EVSYS->channel = channel
+                   | ((generator & 0x7f) << 16) // EVGEN
+                   | (0x1 << 24) // PATH (resynchronized)
+                   | (0x1 << 26) // EDGSEL (rising edge)
+                   ;
+}
+
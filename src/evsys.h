@@ -0,0 +1,19 @@
+#ifndef EVSYS_H
+#define EVSYS_H
+
+#include <stdint.h>
+
+// Table 24-6: event generators
+#define EVSYS_GEN_EIC_EXTINT(x) (0x0c + (x))
+#define EVSYS_GEN_DMAC_CH(x)    (0x1e + (x))
+#define EVSYS_GEN_TC3_OVF       0x33
+#define EVSYS_GEN_TC3_MC(x)     (0x34 + (x))
+
+// Table 24-7: event users
+#define EVSYS_USER_DMAC_CH(x) (x)
+
+void evsys_init(void);
+void evsys_connect(uint8_t channel, uint8_t generator, uint8_t user);
+
+#endif
+
@@ -0,0 +1,58 @@
+#include "filter.h"
+
+#define ONE (1 << FILTER_FRACTION_BITS)
+
+// Starts as if initial had always been the input
+bool filter_init(struct filter_t *filter, uint8_t oversampling_shift, enum filter_smoothing_e smoothing, uint8_t smoothing_shift, uint8_t decimation, uint16_t initial)
+{
+    if(oversampling_shift > FILTER_MAX_SHIFT || smoothing_shift > FILTER_MAX_SHIFT || !decimation)
+        return false;
+
+    filter->oversampling_shift = oversampling_shift;
+    filter->smoothing = smoothing;
+    filter->smoothing_shift = smoothing_shift;
+    filter->decimation = decimation;
+
+    int32_t value = (int32_t) initial << FILTER_FRACTION_BITS;
+    filter->sum = 0;
+    filter->summed = 0;
+    filter->value = value;
+    for(size_t i = 0; i < (1u << FILTER_MAX_SHIFT); ++i)
+        filter->ring[i] = value;
+    filter->ring_index = 0;
+    filter->ring_sum = value << smoothing_shift;
+    filter->decimated = 0;
+    return true;
+}
+
+/* Constant cost whatever the parameters, output is only written (rounded to
+ * the input resolution) when the function returns true
+ */
+bool filter_push(struct filter_t *filter, uint16_t sample, uint16_t *output)
+{
+    // Oversampling: the extra bits of the sum are kept as fraction bits
+    filter->sum += sample;
+    if(++filter->summed < (1u << filter->oversampling_shift))
+        return false;
+    int32_t x = (int32_t) (filter->sum << (FILTER_FRACTION_BITS - filter->oversampling_shift));
+    filter->sum = 0;
+    filter->summed = 0;
+
+    if(filter->smoothing == FILTER_IIR)
+        filter->value += (x - filter->value) >> filter->smoothing_shift;
+    else
+    {
+        uint8_t length_mask = (1u << filter->smoothing_shift) - 1;
+        filter->ring_sum += x - filter->ring[filter->ring_index];
+        filter->ring[filter->ring_index] = x;
+        filter->ring_index = (filter->ring_index + 1) & length_mask;
+        filter->value = filter->ring_sum >> filter->smoothing_shift;
+    }
+
+    if(++filter->decimated < filter->decimation)
+        return false;
+    filter->decimated = 0;
+    *output = (filter->value + ONE / 2) >> FILTER_FRACTION_BITS;
+    return true;
+}
+
@@ -0,0 +1,47 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Fixed-point filter for 16-bit samples, with only adds and constant shifts
+ * per sample (Cortex-M0: no FPU, no divider):
+ *     oversampling: sum of 2^oversampling_shift samples
+ *     smoothing:    one-pole IIR (alpha = 2^-smoothing_shift)
+ *                   or moving average over 2^smoothing_shift values
+ *     decimation:   one output every decimation smoothed values
+ */
+#define FILTER_FRACTION_BITS 8
+#define FILTER_MAX_SHIFT 4 // Oversampling and moving average length
+
+enum filter_smoothing_e
+{
+    FILTER_IIR,
+    FILTER_MOVING_AVERAGE
+};
+
+struct filter_t
+{
+    // Parameters
+    uint8_t oversampling_shift;
+    enum filter_smoothing_e smoothing;
+    uint8_t smoothing_shift;
+    uint8_t decimation;
+
+    // State
+    uint32_t sum; // Raw input counts
+    uint8_t summed;
+    int32_t value; // Values from here on are in FILTER_FRACTION_BITS fixed point
+    int32_t ring[1 << FILTER_MAX_SHIFT];
+    uint8_t ring_index;
+    int32_t ring_sum;
+    uint8_t decimated;
+};
+
+bool filter_init(struct filter_t *filter, uint8_t oversampling_shift, enum filter_smoothing_e smoothing, uint8_t smoothing_shift, uint8_t decimation, uint16_t initial);
+bool filter_push(struct filter_t *filter, uint16_t sample, uint16_t *output);
+
+#endif
+
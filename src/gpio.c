@@ -97,6 +97,17 @@ void gpio_enable_pull(enum gpio_port_e port, uint8_t pin, bool up)
     gpio_set_output(port, pin, up);
 }
 
+/* Keeps the input buffer of a pin given to a peripheral, so that gpio_read
+ * still reads its level
+ */
+void gpio_enable_input(enum gpio_port_e port, uint8_t pin)
+{
+    pin &= 0x1f;
+
+    volatile struct gpio_t *p = PORT(port);
+    p->pincfg[pin] |= (1 << 1); // INEN
+}
+
 bool gpio_read(enum gpio_port_e port, uint8_t pin)
 {
     pin &= 0x1f;
@@ -106,3 +117,12 @@ bool gpio_read(enum gpio_port_e port, uint8_t pin)
     return (p->in & mask) != 0;
 }
 
+
+/* OUTSET/OUTCLR of the port, for other masters than the CPU (e.g. DMAC) to
+ * drive pins
+ */
+volatile uint32_t *gpio_output_register(enum gpio_port_e port, bool high)
+{
+    size_t offset = (high ? offsetof(struct gpio_t, outset) : offsetof(struct gpio_t, outclr));
+    return (volatile uint32_t*) ((uint32_t) PORT(port) + offset);
+}
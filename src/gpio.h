@@ -27,7 +27,9 @@ void gpio_configure_function(enum gpio_port_e port, uint8_t pin, enum gpio_funct
 void gpio_configure_io(enum gpio_port_e port, uint8_t pin, bool output);
 void gpio_set_output(enum gpio_port_e port, uint8_t pin, bool high);
 void gpio_enable_pull(enum gpio_port_e port, uint8_t pin, bool up);
+void gpio_enable_input(enum gpio_port_e port, uint8_t pin);
 bool gpio_read(enum gpio_port_e port, uint8_t pin);
+volatile uint32_t *gpio_output_register(enum gpio_port_e port, bool high);
 
 #endif
 
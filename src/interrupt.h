@@ -4,5 +4,12 @@
 #define interrupt_enable() __asm__ __volatile__("cpsie i")
 #define interrupt_disable() __asm__ __volatile__("cpsid i")
 
+// Nestable critical sections, also usable from an interrupt handler
+#define interrupt_save(primask) __asm__ __volatile__("mrs %0, primask\n\tcpsid i" : "=r" (primask) :: "memory")
+#define interrupt_restore(primask) __asm__ __volatile__("msr primask, %0" :: "r" (primask) : "memory")
+
+// Keeps the compiler from moving memory accesses across this point
+#define compiler_barrier() __asm__ __volatile__("" ::: "memory")
+
 #endif
 
@@ -6,7 +6,8 @@
 int main(void)
 {
     talabardine_init();
-    for(;;);
+    for(;;)
+        talabardine_poll();
     return 0;
 }
 
@@ -17,9 +17,11 @@ struct __attribute__((packed)) nvic_t
 enum nvic_interrupt_e
 {
     NVIC_EIC = 4,
+    NVIC_DMAC = 6,
     NVIC_USB = 7,
     NVIC_SERCOM0 = 9,
-    NVIC_TC3 = 18
+    NVIC_TC3 = 18,
+    NVIC_TC4 = 19
 };
 
 #define NVIC ((volatile struct nvic_t*) 0xe000e100)
@@ -27,6 +29,7 @@ enum nvic_interrupt_e
 #define nvic_enable(id)  (NVIC->iser = (1u << (id)))
 #define nvic_disable(id) (NVIC->icer = (1u << (id)))
 #define nvic_clear(id)   (NVIC->icpr = (1u << (id)))
+#define nvic_set_pending(id) (NVIC->ispr = (1u << (id)))
 #define nvic_set_priority(id, pr) do \
 { \
     volatile uint32_t *pipr = &NVIC->ipr[(id) >> 2]; \
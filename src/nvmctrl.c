@@ -20,6 +20,18 @@ struct __attribute__((packed)) nvmctrl_t
 
 #define NVMCTRL ((volatile struct nvmctrl_t*) 0x41004000)
 
+#define CTRLA_CMDEX (0xa5 << 8)
+#define CMD_ER  0x02 // Erase row
+#define CMD_WP  0x04 // Write page
+#define CMD_PBC 0x44 // Page buffer clear
+
+#define CTRLB_MANW (1 << 7)
+
+#define INTFLAG_READY (1 << 0)
+#define INTFLAG_ERROR (1 << 1)
+
+#define STATUS_ERRORS (0x7 << 2) // PROGE, LOCKE, NVME
+
 void nvmctrl_set_wait_states(uint8_t waitstates)
 {
     waitstates &= 0xf;
@@ -30,3 +42,39 @@ void nvmctrl_set_wait_states(uint8_t waitstates)
     NVMCTRL->ctrlb = ctrlb;
 }
 
+// ADDR is in 16-bit words
+static bool command(uint8_t cmd, uint32_t address)
+{
+    while(!(NVMCTRL->intflag & INTFLAG_READY));
+    NVMCTRL->status = STATUS_ERRORS;
+    NVMCTRL->addr = address >> 1;
+    NVMCTRL->ctrla = CTRLA_CMDEX | cmd;
+    while(!(NVMCTRL->intflag & INTFLAG_READY));
+    return !(NVMCTRL->status & STATUS_ERRORS);
+}
+
+/* Erases the row at address (row aligned), then writes words from its start.
+ * The CPU stalls on flash accesses meanwhile, so this must not erase the
+ * code, and interrupt latency suffers: not to be used while playing.
+ */
+bool nvmctrl_write_row(uint32_t address, const uint32_t *data, size_t words)
+{
+    if(address % NVMCTRL_ROW_SIZE || words > NVMCTRL_ROW_SIZE / 4)
+        return false;
+
+    NVMCTRL->ctrlb |= CTRLB_MANW; // Pages are only written by CMD_WP
+    if(!command(CMD_ER, address))
+        return false;
+
+    volatile uint32_t *flash = (volatile uint32_t*) address;
+    for(size_t page = 0; page < words; page += NVMCTRL_PAGE_SIZE / 4)
+    {
+        if(!command(CMD_PBC, address))
+            return false;
+        for(size_t i = page; i < words && i < page + NVMCTRL_PAGE_SIZE / 4; ++i)
+            flash[i] = data[i]; // 32-bit writes to the page buffer
+        if(!command(CMD_WP, address + page * 4))
+            return false;
+    }
+    return true;
+}
@@ -2,8 +2,15 @@
 #define NVMCTRL_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// 22.6.4: rows of four pages are erased at once, pages are written at once
+#define NVMCTRL_PAGE_SIZE 64
+#define NVMCTRL_ROW_SIZE (4 * NVMCTRL_PAGE_SIZE)
 
 void nvmctrl_set_wait_states(uint8_t waitstates);
+bool nvmctrl_write_row(uint32_t address, const uint32_t *data, size_t words);
 
 #endif
 
@@ -0,0 +1,106 @@
+#include <stddef.h>
+
+#include "octave_map.h"
+#include "interrupt.h"
+#include "gclk.h"
+#include "systick.h"
+
+static struct
+{
+    struct octave_boundary_t boundaries[OCTAVE_MAP_MAX];
+    uint32_t dwell[OCTAVE_MAP_MAX]; // CPU cycles
+    uint8_t n;
+
+    uint8_t current;
+    uint8_t candidate; // Register the pressure is in, waiting for its dwell
+    uint32_t since;
+} context;
+
+/* May be called at runtime, e.g. to adjust the map to a player: boundaries
+ * must be increasing and each falling threshold at most its rising one.
+ * The register being played is kept, as long as it still exists.
+ */
+bool octave_map_set(const struct octave_boundary_t *boundaries, uint8_t n)
+{
+    if(n > OCTAVE_MAP_MAX)
+        return false;
+    uint32_t cycles_per_ms = gclk_get_frequency(GCLK0) / 1000;
+    for(size_t i = 0; i < n; ++i)
+    {
+        if(boundaries[i].falling > boundaries[i].rising)
+            return false;
+        if(i > 0 && boundaries[i].falling < boundaries[i - 1].rising)
+            return false;
+        // Timed with SysTick, the dwell must be shorter than its period
+        if(boundaries[i].dwell_ms * cycles_per_ms >= SYSTICK_MASK)
+            return false;
+    }
+
+    uint32_t primask;
+    interrupt_save(primask);
+    for(size_t i = 0; i < n; ++i)
+    {
+        context.boundaries[i] = boundaries[i];
+        context.dwell[i] = boundaries[i].dwell_ms * cycles_per_ms;
+    }
+    context.n = n;
+    if(context.current > n)
+        context.current = n;
+    context.candidate = context.current;
+    interrupt_restore(primask);
+    return true;
+}
+
+/* Register (0: silence, up to n) for the new pressure. Whatever the noise
+ * around a threshold, the register only changes once per crossing. The note
+ * starts and stops at once: from silence, the first register is taken as
+ * soon as its rising threshold is crossed, and silence as soon as the first
+ * falling one is. Between registers, the change waits until the pressure
+ * stayed in the new register for the longest dwell of the boundaries crossed.
+ */
+uint8_t octave_map_update(uint16_t pressure)
+{
+    if(!context.n)
+        return 0;
+    uint32_t now = systick_now();
+    if(pressure < context.boundaries[0].falling)
+    {
+        context.current = 0;
+        context.candidate = 0;
+        return 0;
+    }
+    if(context.current == 0 && pressure >= context.boundaries[0].rising)
+    {
+        context.current = 1;
+        context.candidate = 1;
+        context.since = now;
+    }
+
+    // Only boundaries between registers from here on
+    uint8_t target = context.current;
+    uint32_t dwell = 0;
+    while(target < context.n && pressure >= context.boundaries[target].rising)
+    {
+        if(context.dwell[target] > dwell)
+            dwell = context.dwell[target];
+        ++target;
+    }
+    while(target > 1 && pressure < context.boundaries[target - 1].falling)
+    {
+        --target;
+        if(context.dwell[target] > dwell)
+            dwell = context.dwell[target];
+    }
+
+    if(target != context.candidate)
+    {
+        context.candidate = target;
+        context.since = now;
+    }
+    // SysTick wraps within a second: since must not age past the dwell
+    systick_saturate(context.since, now, dwell);
+    if(target != context.current && systick_elapsed(context.since, now) >= dwell)
+        context.current = target;
+    return context.current;
+}
+
@@ -0,0 +1,25 @@
+#ifndef OCTAVE_MAP_H
+#define OCTAVE_MAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define OCTAVE_MAP_MAX 4 // Boundaries
+
+/* Boundary between register i and i + 1 (register 0: silence), crossed
+ * upwards at rising and downwards at falling, once the pressure stayed on
+ * the other side for dwell_ms. The boundary with silence is crossed at once,
+ * its dwell_ms is ignored.
+ */
+struct octave_boundary_t
+{
+    uint16_t rising; // Counts
+    uint16_t falling; // Counts, at most rising
+    uint8_t dwell_ms;
+};
+
+bool octave_map_set(const struct octave_boundary_t *boundaries, uint8_t n);
+uint8_t octave_map_update(uint16_t pressure);
+
+#endif
+
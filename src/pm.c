@@ -20,6 +20,10 @@ struct __attribute__((packed)) pm_t
 
 #define PM ((volatile struct pm_t*) 0x40000400)
 
+// ARMv6-M System Control Register
+#define SCB_SCR (*(volatile uint32_t*) 0xe000ed10)
+#define SCR_SLEEPDEEP (1 << 2)
+
 /*
  * Table 16-1. Peripheral Clock Default State
  * CLK_PAC0_APB    Enabled
@@ -59,3 +63,12 @@ void pm_enable_APB_clock(enum pm_clock_e clock, bool enable)
     *mask = tmp;
 }
 
+/* Sleeps until the next interrupt, which is taken right away unless
+ * interrupts are disabled (the CPU still wakes up)
+ */
+void pm_idle(enum pm_idle_e mode)
+{
+    SCB_SCR &= ~SCR_SLEEPDEEP; // IDLE, not STANDBY
+    PM->sleep = mode;
+    __asm__ __volatile__("dsb\n\twfi");
+}
@@ -48,7 +48,16 @@ enum pm_clock_e
     PM_CLK_TCC3 = 88
 };
 
+// 16.6.2.8.2: clock domains stopped in IDLE sleep mode
+enum pm_idle_e
+{
+    PM_IDLE_CPU = 0,
+    PM_IDLE_AHB, // CPU and AHB
+    PM_IDLE_APB // CPU, AHB and APB
+};
+
 void pm_enable_APB_clock(enum pm_clock_e clock, bool enable);
+void pm_idle(enum pm_idle_e mode);
 
 #endif
 
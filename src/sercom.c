@@ -3,6 +3,7 @@
 #include "sercom.h"
 #include "gclk.h"
 #include "config.h"
+#include "interrupt.h"
 
 struct __attribute__((packed)) sercom_usart_t
 {
@@ -89,11 +90,14 @@ struct __attribute__((packed)) sercom_i2c_master_t
 #define INTFLAG_DRE (1 << 0)
 #define INTFLAG_RXC (1 << 2)
 
+#define SPI_CTRLB_RXEN (1 << 17)
+
 #define I2C_CTRLA_SWRST (1 << 0)
 #define I2C_CTRLA_ENABLE (1 << 1)
 #define I2C_CTRLA_MODE_MASTER (0x5 << 2)
 #define I2C_CTRLA_SCLSM (1 << 27)
 
+#define I2C_CTRLB_SMEN (1 << 8)
 #define I2C_CTRLB_CMD_NOP (0x0 << 16)
 #define I2C_CTRLB_CMD_ACKSTART (0x1 << 16)
 #define I2C_CTRLB_CMD_ACKREAD (0x2 << 16)
@@ -105,6 +109,8 @@ struct __attribute__((packed)) sercom_i2c_master_t
 #define I2C_STATUS_BUSSTATE_SHIFT 4
 #define I2C_STATUS_ARBLOST (1 << 1)
 #define I2C_STATUS_RXNACK (1 << 2)
+// BUSERR, ARBLOST, LOWTOUT, MEXTTOUT, SEXTTOUT, LENERR (cleared by writing one)
+#define I2C_STATUS_ERRORS 0x0743
 
 #define I2C_INTFLAG_MB (1 << 0)
 #define I2C_INTFLAG_SB (1 << 1)
@@ -122,26 +128,37 @@ enum i2c_master_busstate_e
     I2C_STATUS_BUSSTATE_BUSY
 };
 
+// Failed transactions (no ACK, arbitration lost) are restarted this many times
+#define I2C_RETRIES 4
+
+// Queue of transactions, the head one being on the bus
 static volatile struct  
 {
+    struct sercom_i2c_transfer_t *head;
+    struct sercom_i2c_transfer_t *tail;
+
     enum
     {
-        I2C_STATE_IDLE,
-        I2C_STATE_ERROR,
         I2C_STATE_WRITE,
-        I2C_STATE_READ,
-        I2C_STATE_DONE
+        I2C_STATE_READ
     } state;
     
-    union
-    {
-        uint8_t *ptr;
-        const uint8_t *cptr;
-    } data;
-    
-    size_t size;
+    size_t index;
+    uint8_t retries;
 } i2c_master_context[N_SERCOMS];
 
+// DMA mode: called from the SERCOM interrupt on bus errors, see sercom_i2c_set_dma_mode
+static void (*i2c_dma_error_callbacks[N_SERCOMS])(uint8_t channel);
+
+// Queue of asynchronous transfers, the head one being on the bus
+static struct
+{
+    struct sercom_spi_transfer_t *head;
+    struct sercom_spi_transfer_t *tail;
+    size_t tx; // Bytes written to DATA
+    size_t rx; // Bytes read from DATA
+} spi_master_context[N_SERCOMS];
+
 static char digit2char(uint8_t x)
 {
     x &= 0xf;
@@ -196,18 +213,56 @@ static inline uint8_t hz_to_baud_sync(uint32_t f_Hz)
 }
 
 // Assumes a 48MHz clock
-static inline uint32_t hz_to_baud_i2c_master(uint32_t f_Hz)
+static inline bool hz_to_baud_i2c_master(uint32_t f_Hz, uint32_t *baud)
 {
     /*
      * 28.6.2.4.1
-     * Let's assume BAUDLOW = 0
-     * Then, BAUD = 24e6 / f_Hz - 5.36
-     * Provided that t_Rise <= 15ns as specified
+     * f_SCL = 48e6 / (10 + BAUD + BAUDLOW + 48e6 * t_Rise)
+     * SCL high lasts BAUD + 5 cycles, SCL low lasts BAUDLOW + 5 cycles.
+     * t_Rise is left out, which only lowers f_SCL.
+     *
+     * I2C specification (UM10204, table 10), minimum SCL low / high times:
+     *     Sm  (100kHz): 4.7us / 4.0us
+     *     Fm  (400kHz): 1.3us / 0.6us
+     *     Fm+ (1MHz):   0.5us / 0.26us
+     * BAUDLOW = BAUD does not fit Fm: 1.25us low at 400kHz
      */
-    uint32_t baud = 24000000u / f_Hz - 5;
-    if(baud > 0xff)
-        baud = 0xff;
-    return baud;
+    uint32_t low_ns, high_ns;
+    if(f_Hz > 1000000)
+        return false; // Hs-mode is not supported
+    else if(f_Hz > 400000)
+    {
+        low_ns = 500;
+        high_ns = 260;
+    }
+    else if(f_Hz > 100000)
+    {
+        low_ns = 1300;
+        high_ns = 600;
+    }
+    else
+    {
+        low_ns = 4700;
+        high_ns = 4000;
+    }
+
+    // In 48MHz cycles, rounded up
+    uint32_t total = (48000000u + f_Hz - 1) / f_Hz - 10;
+    uint32_t low = (low_ns * 48 + 999) / 1000 - 5;
+    uint32_t high = (high_ns * 48 + 999) / 1000 - 5;
+    if(total < low + high)
+        return false;
+
+    // What is left is shared between both phases
+    low += (total - low - high) / 2;
+    high = total - low;
+    if(low > 0xff || high > 0xff)
+        return false;
+
+    *baud = high // BAUD
+          | (low << 8) // BAUDLOW
+          ;
+    return true;
 }
 
 
@@ -302,9 +357,12 @@ void sercom_init_spi_master(uint8_t channel, enum spi_dopo_e dopo, enum spi_dipo
                | (0 << 29) // CPOL
                | (0 << 30) // DORD
                ;
+    spi_master_context[channel].head = NULL;
+    spi_master_context[channel].tail = NULL;
+
     spi->ctrlb = (0x0 << 0) // CHSIZE (8bit)
                | (0 << 13) // MSSEN (Software-driven /CE)
-               | (1 << 17) // RXEN
+               | SPI_CTRLB_RXEN
                | (0x3 << 22) // Clear fifos
                ;
     while(spi->syncbusy & SYNCBUSY_SYSOP);
@@ -334,19 +392,129 @@ void sercom_spi_burst(uint8_t channel, enum gpio_port_e ce_port, uint8_t ce_pin,
     gpio_set_output(ce_port, ce_pin, true);
 }
 
+static void spi_start(uint8_t channel)
+{
+    volatile struct sercom_spi_t *spi = SERCOM(channel);
+    struct sercom_spi_transfer_t *transfer = spi_master_context[channel].head;
+
+    spi_master_context[channel].tx = 0;
+    spi_master_context[channel].rx = 0;
+    gpio_set_output(transfer->ce_port, transfer->ce_pin, false);
+    spi->intenset = INTFLAG_DRE | INTFLAG_RXC;
+}
+
+/* Queues a transfer, which is started right away if the bus is free, and
+ * returns false if the transfer is already queued.
+ * The transfer must stay untouched until its callback is called.
+ */
+bool sercom_spi_submit(uint8_t channel, struct sercom_spi_transfer_t *transfer)
+{
+    channel %= NCHANS;
+    uint32_t primask;
+    bool ok = true;
+
+    interrupt_save(primask);
+    for(struct sercom_spi_transfer_t *t = spi_master_context[channel].head; t; t = t->next)
+        if(t == transfer)
+            ok = false;
+    if(ok && transfer->size)
+    {
+        transfer->next = NULL;
+        if(spi_master_context[channel].head)
+            spi_master_context[channel].tail->next = transfer;
+        else
+            spi_master_context[channel].head = transfer;
+        spi_master_context[channel].tail = transfer;
+        if(spi_master_context[channel].head == transfer)
+            spi_start(channel);
+    }
+    interrupt_restore(primask);
+    return ok;
+}
+
+bool sercom_spi_busy(uint8_t channel)
+{
+    channel %= NCHANS;
+    return spi_master_context[channel].head != NULL;
+}
+
+/* At most two bytes are in flight (shift register and DATA) so that RXC
+ * always keeps up, then the next transfer starts from the same interrupt
+ */
+void sercom_spi_interrupt(uint8_t channel)
+{
+    channel %= NCHANS;
+    volatile struct sercom_spi_t *spi = SERCOM(channel);
+    struct sercom_spi_transfer_t *transfer = spi_master_context[channel].head;
+    if(!transfer)
+    {
+        spi->intenclr = INTFLAG_DRE | INTFLAG_RXC;
+        return;
+    }
+
+    if(spi->intflag & INTFLAG_RXC)
+    {
+        uint8_t byte = spi->data;
+        if(transfer->rx)
+            transfer->rx[spi_master_context[channel].rx] = byte;
+        if(++spi_master_context[channel].rx == transfer->size)
+        {
+            gpio_set_output(transfer->ce_port, transfer->ce_pin, true);
+            spi->intenclr = INTFLAG_DRE | INTFLAG_RXC;
+
+            spi_master_context[channel].head = transfer->next;
+            if(transfer->next)
+                spi_start(channel);
+            if(transfer->callback)
+                transfer->callback(transfer);
+            return;
+        }
+
+        // A byte left the pipe, there is room for the next one
+        if(spi_master_context[channel].tx < transfer->size)
+            spi->intenset = INTFLAG_DRE;
+    }
+
+    size_t tx = spi_master_context[channel].tx;
+    if(tx < transfer->size && (spi->intflag & INTFLAG_DRE) && tx - spi_master_context[channel].rx < 2)
+    {
+        spi->data = (transfer->tx ? transfer->tx[tx] : 0);
+        spi_master_context[channel].tx = ++tx;
+    }
+
+    // DRE stays set while waiting for RXC: the interrupt would never end
+    if(tx == transfer->size || tx - spi_master_context[channel].rx == 2)
+        spi->intenclr = INTFLAG_DRE;
+}
+
+// DATA register, source and destination of SPI DMA transfers
+volatile void *sercom_spi_data_register(uint8_t channel)
+{
+    channel %= NCHANS;
+    volatile struct sercom_spi_t *spi = SERCOM(channel);
+    return &spi->data;
+}
+
 static inline enum i2c_master_busstate_e sercom_i2c_get_busstate(uint8_t channel)
 {
     volatile struct sercom_i2c_master_t *i2c = SERCOM(channel);
     return ((i2c->status >> I2C_STATUS_BUSSTATE_SHIFT) & 0x3);
 }
 
-// Assumes that GCLK0 is running at 48MHz
-void sercom_init_i2c_master(uint8_t channel, uint32_t baudrate_Hz)
+/* Assumes that GCLK0 is running at 48MHz
+ * Returns false if baudrate_Hz cannot meet the I2C timings (up to Fm+)
+ */
+bool sercom_init_i2c_master(uint8_t channel, uint32_t baudrate_Hz)
 {
     channel %= NCHANS;
     volatile struct sercom_i2c_master_t *i2c = SERCOM(channel);
+    uint32_t baud;
+
+    if(!hz_to_baud_i2c_master(baudrate_Hz, &baud))
+        return false;
     
-    i2c_master_context[channel].state = I2C_STATE_IDLE;
+    i2c_master_context[channel].head = NULL;
+    i2c_master_context[channel].tail = NULL;
 
     // Connect SERCOMx_CORE clock to GCLK0 (main)
     // GCLK0 must be running at 48MHz prior to this point
@@ -362,10 +530,8 @@ void sercom_init_i2c_master(uint8_t channel, uint32_t baudrate_Hz)
          * 5.2. Write the Baud Rate register (BAUD) to generate the desired baud rate.
          */
         uint32_t speed;
-        if(baudrate_Hz >= 1000000)
-            speed = (2 << 24); // Hs-mode
-        else if(baudrate_Hz > 400000)
-            speed = (1 << 24); // Fm+
+        if(baudrate_Hz > 400000)
+            speed = (1 << 24); // Fm+, up to 1MHz included
         else
             speed = 0; // Sm or Fm
 
@@ -376,7 +542,7 @@ void sercom_init_i2c_master(uint8_t channel, uint32_t baudrate_Hz)
                    | I2C_CTRLB_FIFOCLR_RX
                    ;
         while(i2c->syncbusy & SYNCBUSY_SYSOP);
-        i2c->baud = hz_to_baud_i2c_master(baudrate_Hz);
+        i2c->baud = baud;
                  
         i2c->ctrla |= I2C_CTRLA_ENABLE; // Enable
         while(i2c->syncbusy & SYNCBUSY_ENABLE);
@@ -385,89 +551,242 @@ void sercom_init_i2c_master(uint8_t channel, uint32_t baudrate_Hz)
         i2c->status = (I2C_STATUS_BUSSTATE_IDLE << I2C_STATUS_BUSSTATE_SHIFT);
         while(i2c->syncbusy & SYNCBUSY_SYSOP);
     } while(sercom_i2c_get_busstate(channel) != I2C_STATUS_BUSSTATE_IDLE);
+
+    return true;
 }
 
-void sercom_i2c_write(uint8_t channel, uint16_t address, const uint8_t *data, size_t length)
+#define I2C_INTFLAGS (I2C_INTFLAG_MB | I2C_INTFLAG_SB | I2C_INTFLAG_ERROR)
+
+// Address packet of the current phase of the head transaction
+static void i2c_start(uint8_t channel)
 {
-    channel %= NCHANS;
-    address &= 0x7f;
-    address <<= 1;
     volatile struct sercom_i2c_master_t *i2c = SERCOM(channel);
-    
-    do 
+    struct sercom_i2c_transfer_t *transfer = i2c_master_context[channel].head;
+    bool read = (transfer->tx_size == 0);
+
+    i2c_master_context[channel].state = (read ? I2C_STATE_READ : I2C_STATE_WRITE);
+    i2c_master_context[channel].index = 0;
+
+    i2c->intflag = I2C_INTFLAGS;
+    i2c->intenset = I2C_INTFLAGS;
+    i2c->addr = ((transfer->address & 0x7f) << 1) | read;
+}
+
+static void i2c_complete(uint8_t channel, bool ok)
+{
+    volatile struct sercom_i2c_master_t *i2c = SERCOM(channel);
+    struct sercom_i2c_transfer_t *transfer = i2c_master_context[channel].head;
+
+    i2c_master_context[channel].head = transfer->next;
+    transfer->status = (ok ? SERCOM_I2C_DONE : SERCOM_I2C_FAILED);
+    if(i2c_master_context[channel].head)
     {
-        i2c_master_context[channel].state = I2C_STATE_WRITE;
-        i2c_master_context[channel].data.cptr = data;
-        i2c_master_context[channel].size = length;
-        
-        i2c->intflag = I2C_INTFLAG_MB
-                     | I2C_INTFLAG_SB
-                     | I2C_INTFLAG_ERROR
-                     ;
-        i2c->intenset = I2C_INTFLAG_MB
-                      | I2C_INTFLAG_SB
-                      | I2C_INTFLAG_ERROR
-                      ;
-        i2c->addr = address;
-        
-        while(i2c_master_context[channel].state != I2C_STATE_DONE && i2c_master_context[channel].state != I2C_STATE_ERROR);
-    } while(i2c_master_context[channel].state == I2C_STATE_ERROR);
-    
-    while(sercom_i2c_get_busstate(channel) != I2C_STATUS_BUSSTATE_IDLE);
+        i2c_master_context[channel].retries = 0;
+        i2c_start(channel);
+    }
+    else
+        i2c->intenclr = I2C_INTFLAGS;
+
+    if(transfer->callback)
+        transfer->callback(transfer);
+}
+
+/* Queues a transaction: tx_size bytes are written, then rx_size bytes are
+ * read after a repeated START (e.g. register address, then register data). Returns false if the transaction is already
+ * queued. It must stay untouched until its status is no longer
+ * SERCOM_I2C_PENDING; the callback, if any, is called from the SERCOM
+ * interrupt.
+ */
+bool sercom_i2c_submit(uint8_t channel, struct sercom_i2c_transfer_t *transfer)
+{
+    channel %= NCHANS;
+    uint32_t primask;
+    bool ok = (transfer->tx_size || transfer->rx_size);
+
+    interrupt_save(primask);
+    for(struct sercom_i2c_transfer_t *t = i2c_master_context[channel].head; t; t = t->next)
+        if(t == transfer)
+            ok = false;
+    if(ok)
+    {
+        transfer->next = NULL;
+        transfer->status = SERCOM_I2C_PENDING;
+        if(i2c_master_context[channel].head)
+            i2c_master_context[channel].tail->next = transfer;
+        else
+        {
+            i2c_master_context[channel].head = transfer;
+            i2c_master_context[channel].retries = 0;
+            i2c_start(channel);
+        }
+        i2c_master_context[channel].tail = transfer;
+    }
+    interrupt_restore(primask);
+    return ok;
+}
+
+/* Blocking helpers on top of the queue, retrying until success like before.
+ * They rely on the SERCOM interrupt, so they must not be called from a
+ * handler of the same or higher priority.
+ */
+static void i2c_transfer(uint8_t channel, struct sercom_i2c_transfer_t *transfer)
+{
+    do
+    {
+        sercom_i2c_submit(channel, transfer);
+        while(transfer->status == SERCOM_I2C_PENDING);
+    } while(transfer->status == SERCOM_I2C_FAILED);
+}
+
+void sercom_i2c_write(uint8_t channel, uint16_t address, const uint8_t *data, size_t length)
+{
+    struct sercom_i2c_transfer_t transfer = {
+        .address = address,
+        .tx = data,
+        .tx_size = length,
+        .rx = NULL,
+        .rx_size = 0,
+        .callback = NULL
+    };
+    i2c_transfer(channel, &transfer);
+}
+
+void sercom_i2c_write_read(uint8_t channel, uint16_t address, const uint8_t *tx, size_t tx_size, uint8_t *rx, size_t rx_size)
+{
+    struct sercom_i2c_transfer_t transfer = {
+        .address = address,
+        .tx = tx,
+        .tx_size = tx_size,
+        .rx = rx,
+        .rx_size = rx_size,
+        .callback = NULL
+    };
+    i2c_transfer(channel, &transfer);
 }
 
 void sercom_i2c_read(uint8_t channel, uint16_t address, uint8_t *data, size_t length)
+{
+    struct sercom_i2c_transfer_t transfer = {
+        .address = address,
+        .tx = NULL,
+        .tx_size = 0,
+        .rx = data,
+        .rx_size = length,
+        .callback = NULL
+    };
+    i2c_transfer(channel, &transfer);
+}
+
+/* Hands the bus over to the DMAC: smart mode so that reading DATA
+ * acknowledges the byte. With ADDR.LENEN, the last byte read is NACKed and
+ * followed by a STOP. The only SERCOM interrupt left is ERROR, on_error is
+ * then called from it (see sercom_i2c_abort).
+ * The queue must be empty and must not be used anymore.
+ */
+void sercom_i2c_set_dma_mode(uint8_t channel, void (*on_error)(uint8_t channel))
 {
     channel %= NCHANS;
-    address &= 0x7f;
-    address <<= 1;
-    address |= 1;
     volatile struct sercom_i2c_master_t *i2c = SERCOM(channel);
-    
-    do 
+
+    i2c->intenclr = I2C_INTFLAGS;
+    i2c_dma_error_callbacks[channel] = on_error;
+
+    // CTRLB.SMEN is enable-protected
+    i2c->ctrla &= ~I2C_CTRLA_ENABLE;
+    while(i2c->syncbusy & SYNCBUSY_ENABLE);
+    i2c->ctrlb = I2C_CTRLB_SMEN;
+    i2c->ctrla |= I2C_CTRLA_ENABLE;
+    while(i2c->syncbusy & SYNCBUSY_ENABLE);
+
+    // Force idle mode
+    i2c->status = (I2C_STATUS_BUSSTATE_IDLE << I2C_STATUS_BUSSTATE_SHIFT);
+    while(i2c->syncbusy & SYNCBUSY_SYSOP);
+
+    i2c->intflag = I2C_INTFLAG_ERROR;
+    if(on_error)
+        i2c->intenset = I2C_INTFLAG_ERROR;
+}
+
+/* DMA mode: ends the transaction on the bus, if any, clears the errors and
+ * forces the bus idle, for the DMAC to start over. Its channels must be
+ * stopped beforehand.
+ */
+void sercom_i2c_abort(uint8_t channel)
+{
+    channel %= NCHANS;
+    volatile struct sercom_i2c_master_t *i2c = SERCOM(channel);
+
+    if(sercom_i2c_get_busstate(channel) == I2C_STATUS_BUSSTATE_OWNER)
     {
-        i2c_master_context[channel].state = I2C_STATE_READ;
-        i2c_master_context[channel].data.ptr = data;
-        i2c_master_context[channel].size = length;
-
-        i2c->intflag = I2C_INTFLAG_MB
-                     | I2C_INTFLAG_SB
-                     | I2C_INTFLAG_ERROR
-                     ;
-        i2c->intenset = I2C_INTFLAG_MB
-                      | I2C_INTFLAG_SB
-                      | I2C_INTFLAG_ERROR
-                      ;
-        i2c->addr = address;
-        
-        while(i2c_master_context[channel].state != I2C_STATE_DONE && i2c_master_context[channel].state != I2C_STATE_ERROR);
-    } while(i2c_master_context[channel].state == I2C_STATE_ERROR);
-    
-    while(sercom_i2c_get_busstate(channel) != I2C_STATUS_BUSSTATE_IDLE);
+        i2c->ctrlb = I2C_CTRLB_SMEN | I2C_CTRLB_ACKACT | I2C_CTRLB_CMD_ACKSTOP;
+        while(i2c->syncbusy & SYNCBUSY_SYSOP);
+    }
+    i2c->status = I2C_STATUS_ERRORS | (I2C_STATUS_BUSSTATE_IDLE << I2C_STATUS_BUSSTATE_SHIFT);
+    while(i2c->syncbusy & SYNCBUSY_SYSOP);
+    i2c->intflag = I2C_INTFLAGS;
+}
+
+volatile void *sercom_i2c_addr_register(uint8_t channel)
+{
+    channel %= NCHANS;
+    volatile struct sercom_i2c_master_t *i2c = SERCOM(channel);
+    return &i2c->addr;
+}
+
+volatile void *sercom_i2c_data_register(uint8_t channel)
+{
+    channel %= NCHANS;
+    volatile struct sercom_i2c_master_t *i2c = SERCOM(channel);
+    return &i2c->data;
+}
+
+static void i2c_error(uint8_t channel)
+{
+    if(++i2c_master_context[channel].retries < I2C_RETRIES)
+        i2c_start(channel);
+    else
+        i2c_complete(channel, false);
 }
 
 void sercom_i2c_interrupt(uint8_t channel)
 {
     volatile struct sercom_i2c_master_t *i2c = SERCOM(channel);
+    struct sercom_i2c_transfer_t *transfer = i2c_master_context[channel].head;
     uint8_t intflag = i2c->intflag;
     uint16_t status = i2c->status;
     enum i2c_master_busstate_e state = sercom_i2c_get_busstate(channel);
+
+    // DMA mode: the queue is not used
+    if(i2c_dma_error_callbacks[channel])
+    {
+        i2c->intflag = I2C_INTFLAG_ERROR;
+        if(intflag & I2C_INTFLAG_ERROR)
+            i2c_dma_error_callbacks[channel](channel);
+        return;
+    }
+
+    if(!transfer)
+    {
+        i2c->intenclr = I2C_INTFLAGS;
+        return;
+    }
     
     if(status & I2C_STATUS_ARBLOST) // Case 1: Arbitration lost or bus error during address packet transmission
     {
         // Never occurred yet, thus untested
-        i2c_master_context[channel].state = I2C_STATE_ERROR;
         i2c->ctrlb = I2C_CTRLB_CMD_ACKSTOP;
         i2c->status = I2C_STATUS_ARBLOST;
         i2c->intflag = I2C_INTFLAG_MB;
+        i2c_error(channel);
         return;
     }
     if(status & I2C_STATUS_RXNACK) // Case 2: Address packet transmit complete  No ACK received
     {
-        i2c_master_context[channel].state = I2C_STATE_ERROR;
         i2c->ctrlb = I2C_CTRLB_CMD_ACKSTOP;
+        while(i2c->syncbusy & SYNCBUSY_SYSOP);
         i2c->status = I2C_STATUS_RXNACK;
         i2c->intflag = I2C_INTFLAG_MB;
+        i2c_error(channel);
         return;
     }
     if(status & 0x0747) // Not supported yet
@@ -482,13 +801,23 @@ void sercom_i2c_interrupt(uint8_t channel)
             switch(i2c_master_context[channel].state)
             {
                 case I2C_STATE_WRITE:
-                    if(i2c_master_context[channel].size--)
-                        i2c->data = *i2c_master_context[channel].data.cptr++;
+                    if(i2c_master_context[channel].index < transfer->tx_size)
+                        i2c->data = transfer->tx[i2c_master_context[channel].index++];
+                    else if(transfer->rx_size)
+                    {
+                        // 28.6.2.4.5: writing ADDR while owning the bus issues a repeated START
+                        i2c_master_context[channel].state = I2C_STATE_READ;
+                        i2c_master_context[channel].index = 0;
+                        i2c->addr = ((transfer->address & 0x7f) << 1) | 1; // Clears MB
+                        return;
+                    }
                     else
                     {
                         i2c->ctrlb = I2C_CTRLB_CMD_ACKSTOP;
                         while(i2c->syncbusy & SYNCBUSY_SYSOP);
-                        i2c_master_context[channel].state = I2C_STATE_DONE;
+                        i2c->intflag = I2C_INTFLAG_MB;
+                        i2c_complete(channel, true);
+                        return;
                     }
                     i2c->intflag = I2C_INTFLAG_MB;
                     return;
@@ -503,26 +832,23 @@ void sercom_i2c_interrupt(uint8_t channel)
             switch(i2c_master_context[channel].state)
             {
                 case I2C_STATE_READ:
-                    if(i2c_master_context[channel].size)
+                    transfer->rx[i2c_master_context[channel].index++] = i2c->data;
+                    if(i2c_master_context[channel].index < transfer->rx_size)
                     {
-                        *i2c_master_context[channel].data.ptr++ = i2c->data;
-                        if(--i2c_master_context[channel].size)
-                        {
-                            i2c->ctrlb = I2C_CTRLB_CMD_ACKREAD;
-                            while(i2c->syncbusy & SYNCBUSY_SYSOP);
-                        }
-                        else
-                        {
-                            i2c->ctrlb = I2C_CTRLB_CMD_ACKSTOP
-                                       | I2C_CTRLB_ACKACT // NACK
-                                       ;
-                            while(i2c->syncbusy & SYNCBUSY_SYSOP);
-                            i2c_master_context[channel].state = I2C_STATE_DONE;
-                        }
+                        i2c->ctrlb = I2C_CTRLB_CMD_ACKREAD;
+                        while(i2c->syncbusy & SYNCBUSY_SYSOP);
                         i2c->intflag = I2C_INTFLAG_SB;
-                        return;
                     }
-                    break;
+                    else
+                    {
+                        i2c->ctrlb = I2C_CTRLB_CMD_ACKSTOP
+                                   | I2C_CTRLB_ACKACT // NACK
+                                   ;
+                        while(i2c->syncbusy & SYNCBUSY_SYSOP);
+                        i2c->intflag = I2C_INTFLAG_SB;
+                        i2c_complete(channel, true);
+                    }
+                    return;
 
                 default:
                     break;
@@ -533,4 +859,4 @@ void sercom_i2c_interrupt(uint8_t channel)
     
     // Should not reach here
     for(;;);
-}
\ No newline at end of file
+}
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 #include "gpio.h"
 
@@ -43,6 +44,38 @@ enum spi_dipo_e
     SPI_IN_PAD3 
 };
 
+struct sercom_spi_transfer_t
+{
+    enum gpio_port_e ce_port;
+    uint8_t ce_pin;
+    const uint8_t *tx; // NULL: zeros are sent
+    uint8_t *rx; // NULL: received bytes are dropped
+    size_t size;
+    void (*callback)(struct sercom_spi_transfer_t *transfer); // From the SERCOM interrupt
+    struct sercom_spi_transfer_t *next; // Private
+};
+
+// ADDR register value for DMA-driven I2C transactions of len bytes (28.8.12)
+#define SERCOM_I2C_ADDR(address, read, len) \
+    ((((address) & 0x7f) << 1) | ((read) ? 1 : 0) | (1 << 13) /* LENEN */ | (((len) & 0xff) << 16))
+
+struct sercom_i2c_transfer_t
+{
+    uint8_t address; // 7 bits
+    const uint8_t *tx; // Written first
+    size_t tx_size;
+    uint8_t *rx; // Then read
+    size_t rx_size;
+    void (*callback)(struct sercom_i2c_transfer_t *transfer); // From the SERCOM interrupt
+    volatile enum
+    {
+        SERCOM_I2C_PENDING,
+        SERCOM_I2C_DONE,
+        SERCOM_I2C_FAILED
+    } status;
+    struct sercom_i2c_transfer_t *next; // Private
+};
+
 // Assumes that GCLK0 is running at 48MHz
 void sercom_init_usart(uint8_t channel, enum usart_txpo_e txpo, enum usart_rxpo_e rxpo, uint32_t baudrate_Hz);
 void sercom_usart_putc(uint8_t channel, char c);
@@ -51,11 +84,21 @@ void sercom_usart_display_half(uint16_t x);
 
 void sercom_init_spi_master(uint8_t channel, enum spi_dopo_e dopo, enum spi_dipo_e dipo, uint32_t baudrate_Hz);
 void sercom_spi_burst(uint8_t channel, enum gpio_port_e ce_port, uint8_t ce_pin, void *dst, const void *src, size_t size);
+volatile void *sercom_spi_data_register(uint8_t channel);
+bool sercom_spi_submit(uint8_t channel, struct sercom_spi_transfer_t *transfer);
+bool sercom_spi_busy(uint8_t channel);
+void sercom_spi_interrupt(uint8_t channel);
 
-void sercom_init_i2c_master(uint8_t channel, uint32_t baudrate_Hz);
+bool sercom_init_i2c_master(uint8_t channel, uint32_t baudrate_Hz);
 void sercom_i2c_write(uint8_t channel, uint16_t address, const uint8_t *data, size_t length);
 void sercom_i2c_read(uint8_t channel, uint16_t address, uint8_t *data, size_t length);
+void sercom_i2c_write_read(uint8_t channel, uint16_t address, const uint8_t *tx, size_t tx_size, uint8_t *rx, size_t rx_size);
+bool sercom_i2c_submit(uint8_t channel, struct sercom_i2c_transfer_t *transfer);
 void sercom_i2c_interrupt(uint8_t channel);
+void sercom_i2c_set_dma_mode(uint8_t channel, void (*on_error)(uint8_t channel));
+void sercom_i2c_abort(uint8_t channel);
+volatile void *sercom_i2c_addr_register(uint8_t channel);
+volatile void *sercom_i2c_data_register(uint8_t channel);
 
 #endif
 
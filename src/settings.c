@@ -0,0 +1,43 @@
+#include <stddef.h>
+
+#include "settings.h"
+#include "nvmctrl.h"
+
+// Last row of the 128kB flash, left out of the rom region by the linker script
+#define SETTINGS_ADDRESS (0x00020000 - NVMCTRL_ROW_SIZE)
+#define SETTINGS ((const struct settings_t*) SETTINGS_ADDRESS)
+
+// Changes whenever struct settings_t does
+#define SETTINGS_MAGIC 0x54410001
+
+_Static_assert(sizeof(struct settings_t) % 4 == 0, "settings are written by words");
+_Static_assert(sizeof(struct settings_t) <= NVMCTRL_ROW_SIZE, "settings must fit in a row");
+
+static uint32_t checksum(const struct settings_t *settings)
+{
+    const uint32_t *words = (const uint32_t*) settings;
+    uint32_t sum = 0;
+    for(size_t i = 0; i < offsetof(struct settings_t, checksum) / 4; ++i)
+        sum = (sum << 1 | sum >> 31) ^ words[i];
+    return ~sum;
+}
+
+/* NULL if the row was never written (erased flash reads 0xff), or was
+ * written by a firmware with another layout
+ */
+const struct settings_t *settings_get(void)
+{
+    if(SETTINGS->magic != SETTINGS_MAGIC || SETTINGS->checksum != checksum(SETTINGS))
+        return NULL;
+    return SETTINGS;
+}
+
+bool settings_save(const struct settings_t *settings)
+{
+    struct settings_t copy = *settings;
+    copy.magic = SETTINGS_MAGIC;
+    copy.checksum = checksum(&copy);
+    return nvmctrl_write_row(SETTINGS_ADDRESS, (const uint32_t*) &copy, sizeof(copy) / 4)
+        && settings_get() != NULL;
+}
+
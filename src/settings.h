@@ -0,0 +1,20 @@
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Per-instrument settings, kept in the last flash row across firmware updates
+struct settings_t
+{
+    uint32_t magic;
+    uint8_t key_dthr[12]; // 0: not calibrated, see atqt2120_init
+    uint16_t key_full_delta[12]; // Signal drop of a fully covered key
+    uint32_t checksum;
+};
+
+const struct settings_t *settings_get(void);
+bool settings_save(const struct settings_t *settings);
+
+#endif
+
@@ -0,0 +1,48 @@
+#ifndef SYSTICK_H
+#define SYSTICK_H
+
+#include <stdint.h>
+
+struct __attribute__((packed)) systick_t
+{
+    uint32_t csr;
+    uint32_t rvr;
+    uint32_t cvr;
+    uint32_t calib;
+};
+
+#define SYSTICK ((volatile struct systick_t*) 0xe000e010)
+
+#define SYST_CSR_ENABLE (1 << 0)
+#define SYST_CSR_CLKSOURCE (1 << 2) // Processor clock
+
+// SysTick is a 24-bit down counter
+#define SYSTICK_MASK 0xffffff
+
+// Free-running timestamp counter, no interrupt, wraps every 2^24 CPU cycles
+#define systick_init() do \
+{ \
+    SYSTICK->csr = 0; \
+    SYSTICK->rvr = SYSTICK_MASK; \
+    SYSTICK->cvr = 0; \
+    SYSTICK->csr = SYST_CSR_CLKSOURCE | SYST_CSR_ENABLE; \
+} while(0)
+
+// Current timestamp, counting up
+#define systick_now() ((uint32_t) (SYSTICK_MASK - SYSTICK->cvr))
+
+// CPU cycles between two timestamps, as long as less than 2^24 elapsed
+#define systick_elapsed(since, now) (((now) - (since)) & SYSTICK_MASK)
+
+/* Brings since forward to at most limit cycles before now. Called at every
+ * sample, it keeps a timestamp compared against limit from wrapping around,
+ * however long it was not refreshed.
+ */
+#define systick_saturate(since, now, limit) do \
+{ \
+    if(systick_elapsed(since, now) > (limit)) \
+        (since) = ((now) - (limit)) & SYSTICK_MASK; \
+} while(0)
+
+#endif
+
@@ -10,7 +10,15 @@
 #include "eic.h"
 #include "interrupt.h"
 #include "tc.h"
+#include "dmac.h"
+#include "evsys.h"
+#include "systick.h"
 #include "nvmctrl.h"
+#include "settings.h"
+#include "filter.h"
+#include "breath.h"
+#include "drift.h"
+#include "octave_map.h"
 #include "midi.h"
 #include "udc.h"
 #include "usb.h"
@@ -23,8 +31,39 @@
 #define PRESSURE_OCT1 ABP_PA_2_COUNTS(2000)
 #define PRESSURE_OCT2 ABP_PA_2_COUNTS(4000)
 
+/* Registers, see octave_map_update: the note starts and stops without delay,
+ * even from a sharp attack straight into OCT2, while octave changes wait for
+ * the pressure to settle
+ */
+static const struct octave_boundary_t octave_boundaries[] = {
+    {.rising = PRESSURE_OCT1, .falling = ABP_PA_2_COUNTS(1700), .dwell_ms = 0},
+    {.rising = PRESSURE_OCT2, .falling = ABP_PA_2_COUNTS(3600), .dwell_ms = 10}
+};
+
 #define OCTAVE_OFFSET 4
 
+#define PRESSURE_HZ 1000
+/* While the USB bus is suspended, the pressure is only sampled to detect a
+ * breath: as slow as the 8-bit TC3 goes from the 48MHz clock
+ */
+#define PRESSURE_SUSPEND_HZ 200
+
+// Continuous breath output, see breath_update
+const struct breath_config_t breath_config = {
+    .output = BREATH_OUTPUT_CC2,
+    .high_resolution = true,
+    .channel = 0,
+    .curve = BREATH_CURVE_SOFT,
+    .pressure_min = ABP_PA_2_COUNTS(500),
+    .pressure_max = ABP_PA_2_COUNTS(6000),
+    .deadband = 8, // Sensor noise, in 14-bit units
+    .max_rate_hz = 200
+};
+
+#if KEYS_SIGNAL_STREAMING && KEYS_READ_DMA
+#error "Half-holing (KEYS_SIGNAL_STREAMING) needs the I2C queue, set KEYS_READ_DMA to 0"
+#endif
+
 /*
  * Pin mapping:
  *     # USART (SERCOM 1)
@@ -47,7 +86,9 @@
  *         PB07
  */
 
-// KEY_DRTHR must be high enough so that keys are not triggered from the backside of the PCB
+/* KEY_DRTHR must be high enough so that keys are not triggered from the backside of the PCB.
+ * Only used for the keys that were never calibrated, see calibrate_keys
+ */
 #define KEY_DTHR 64
 const struct atqt2120_t keys_config = {
     .keys = {
@@ -69,9 +110,78 @@ const struct atqt2120_t keys_config = {
     .di = 1
 };
 
-static int keys_to_note(uint8_t keys, unsigned int *octave_modifier)
+// Signal drop of a fully covered hole, about twice the detection threshold
+#define KEY_FULL_DELTA (2 * KEY_DTHR)
+
+// Calibration: frames sampled without touch, and minimum touch to noise margin
+#define CALIBRATION_IDLE_FRAMES 500
+#define CALIBRATION_MARGIN 8
+
+#define PITCH_WHEEL_CENTER 0x2000
+#define PITCH_WHEEL_MAX 0x3fff
+#define PITCH_WHEEL_MAX_RATE_HZ 200
+
+/* Velocity of the pressure rise over VELOCITY_LOOKBACK values (counts), in
+ * steps of 2^VELOCITY_SLOPE_SHIFT counts. Not measured: a hand-picked curve,
+ * within one of 127 * (step / 31)^0.6, steeper at first so that soft attacks
+ * still spread over the low velocities. Step 0 gives 1, since velocity 0
+ * would be a note-off. To be tuned by ear on the instrument.
+ */
+#define VELOCITY_SLOPE_SHIFT 4
+static const uint8_t slope_to_velocity[32] = {
+    1, 17, 25, 32, 38, 43, 48, 53, 57, 61, 65, 69, 72, 76, 79, 83,
+    86, 89, 92, 95, 98, 101, 104, 106, 109, 112, 114, 117, 120, 122, 125, 127
+};
+
+_Static_assert((VELOCITY_LOOKBACK & (VELOCITY_LOOKBACK - 1)) == 0, "VELOCITY_LOOKBACK must be a power of two");
+
+// Pitch drift: cents per kPa above DRIFT_REFERENCE, see drift_init
+#define DRIFT_MINIMUM ABP_PA_2_COUNTS(500) // Bottom of the playing range
+#define DRIFT_REFERENCE ABP_PA_2_COUNTS(3000)
+static const int8_t drift_cents_per_kpa[12] = {
+    [MIDI_NOTE_C]  = 4,
+    [MIDI_NOTE_CS] = 4,
+    [MIDI_NOTE_D]  = 4,
+    [MIDI_NOTE_DS] = 4,
+    [MIDI_NOTE_E]  = 4,
+    [MIDI_NOTE_F]  = 4,
+    [MIDI_NOTE_FS] = 4,
+    [MIDI_NOTE_G]  = 4,
+    [MIDI_NOTE_GS] = 4,
+    [MIDI_NOTE_A]  = 4,
+    [MIDI_NOTE_AS] = 4,
+    [MIDI_NOTE_B]  = 4
+};
+
+// Chanter keys (KEY0 to KEY6), see chanter_to_note
+#define KEYS_CHANTER 0x007f
+
+/* Functions of the other keys (KEY7 to KEY11), which come with the same
+ * status read as the chanter keys
+ */
+enum key_function_e
+{
+    KEY_FUNCTION_NONE = 0,
+    KEY_FUNCTION_OCTAVE_UP, // While held
+    KEY_FUNCTION_OCTAVE_DOWN, // While held
+    KEY_FUNCTION_DRONE // Toggles the drone
+};
+
+#define DRONE_CHANNEL 1
+#define DRONE_NOTE MIDI_NOTE_A
+#define DRONE_OCTAVE (OCTAVE_OFFSET - 1)
+
+static const enum key_function_e key_functions[12] = {
+    [7] = KEY_FUNCTION_NONE,
+    [8] = KEY_FUNCTION_NONE,
+    [9] = KEY_FUNCTION_NONE,
+    [10] = KEY_FUNCTION_NONE,
+    [11] = KEY_FUNCTION_NONE
+};
+
+static int chanter_to_note(uint16_t keys, unsigned int *octave_modifier)
 {
-    switch(keys & 0x7f)
+    switch(keys & KEYS_CHANTER)
     {
         case 0x00:
         case 0x40:
@@ -117,11 +227,47 @@ static int keys_to_note(uint8_t keys, unsigned int *octave_modifier)
     }
 }
 
+static int keys_to_note(uint16_t keys, unsigned int *octave_modifier)
+{
+    int note = chanter_to_note(keys, octave_modifier);
+    for(size_t i = 0; i < 12; ++i)
+    {
+        if(!(keys & (1u << i)))
+            continue;
+        if(key_functions[i] == KEY_FUNCTION_OCTAVE_UP)
+            ++*octave_modifier;
+        else if(key_functions[i] == KEY_FUNCTION_OCTAVE_DOWN)
+            --*octave_modifier;
+    }
+    return note;
+}
+
+// Drone keys act when touched
+static void toggle_drone(uint16_t touched)
+{
+    static bool drone = false;
+    for(size_t i = 0; i < 12; ++i)
+    {
+        if(!(touched & (1u << i)) || key_functions[i] != KEY_FUNCTION_DRONE)
+            continue;
+        uint8_t key = MIDI_NOTE_TO_KEY(DRONE_NOTE, DRONE_OCTAVE);
+        if(drone)
+            usb_midi_note_off(DRONE_CHANNEL, key, 64);
+        else
+            usb_midi_note_on(DRONE_CHANNEL, key, 64);
+        drone = !drone;
+    }
+}
+
 static int note_to_midi_key(int note, unsigned int octave)
 {
     return MIDI_NOTE_TO_KEY(note, OCTAVE_OFFSET - 1 + octave);
 }
 
+// Drift curve of the note being played, NULL if none
+static const int16_t *drift;
+static uint8_t velocity; // Of the breath onset, see on_pressure
+
 static void replace_note(int note)
 {
     static int current_note = -1;
@@ -136,7 +282,7 @@ static void replace_note(int note)
     if(current_note != -1)
     {
         //ptr = midi_note_off(command, 0, current_note, 64);
-        usb_midi_note_off(0, note, 64);
+        usb_midi_note_off(0, current_note, 64);
     }
     //else
     //    ptr = command;
@@ -144,8 +290,8 @@ static void replace_note(int note)
     // 2. Play the new note, if any
     if(note != -1)
     {
-        //ptr = midi_note_on(ptr, 0, note, 64);
-        usb_midi_note_on(0, note, 64);
+        //ptr = midi_note_on(ptr, 0, note, velocity);
+        usb_midi_note_on(0, note, velocity);
     }
 
     // 3. Finalize string
@@ -156,6 +302,7 @@ static void replace_note(int note)
 
     // 5. Update current_note
     current_note = note;
+    drift = (note != -1 ? drift_curve((unsigned int) note % 12) : NULL);
 }
 
 static void talabardine_init_gpios(void)
@@ -198,11 +345,289 @@ static void talabardine_init_sercoms(void)
 {
     sercom_init_usart(SERCOM_MIDI_CHANNEL, USART_TXPO_PAD0, USART_RXPO_DISABLE, /*31250*/ 115200);
     sercom_init_spi_master(SERCOM_PRESSURE_CHANNEL, SPI_OUT_PAD312, SPI_IN_PAD0, 800000);
-    sercom_init_i2c_master(SERCOM_KEYS_CHANNEL, 400000);
+    sercom_init_i2c_master(SERCOM_KEYS_CHANNEL, 400000); // AT42QT2120 is limited to Fm, not Fm+
 }
 
-static uint8_t keys;
+static uint16_t keys;
 static uint8_t octave;
+static uint16_t pitch_wheel;
+static uint32_t pitch_wheel_time;
+static uint32_t pitch_wheel_interval; // CPU cycles, from PITCH_WHEEL_MAX_RATE_HZ
+static int16_t half_hole_offset;
+static int16_t drift_offset_now;
+static struct atqt2120_coverage_t key_coverage[12]; // From the calibrated full delta, or KEY_FULL_DELTA
+static struct filter_t pressure_filter;
+static uint16_t pressure_history[VELOCITY_LOOKBACK]; // Last filtered values
+static uint8_t pressure_history_index; // Oldest value
+static volatile bool mute_requested; // Set by the host, see talabardine_poll
+static volatile bool usb_sleeping;
+static bool low_power;
+
+static void on_usb_suspend(bool suspended)
+{
+    usb_sleeping = suspended;
+}
+
+// Wakes the host up, on key touch or breath
+static void wakeup(void)
+{
+    if(usb_remote_wakeup_enabled())
+        udc_remote_wakeup();
+}
+
+static void set_pressure_rate(uint32_t frequency_hz)
+{
+#if PRESSURE_SAMPLING_DMA
+    // TC3 only paces the DMA sampling (see abp_start_sampling), it has no interrupt
+    tc_init(TC3, GCLK0, frequency_hz);
+    tc_enable_overflow_event(TC3, true);
+#else
+    nvic_disable(NVIC_TC3);
+    tc_init(TC3, GCLK0, frequency_hz);
+    nvic_clear(NVIC_TC3);
+    nvic_enable(NVIC_TC3);
+#endif
+}
+
+/* Nothing is sent while the bus is suspended: slow pressure sampling down and
+ * gate the clocks of the SERCOMs that are not needed to wake the host up
+ * (SERCOM1: debug output, SERCOM2: unused)
+ */
+static void set_low_power(bool enable)
+{
+    low_power = enable;
+    if(enable)
+    {
+        set_pressure_rate(PRESSURE_SUSPEND_HZ);
+        pm_enable_APB_clock(PM_CLK_SERCOM1, false);
+        pm_enable_APB_clock(PM_CLK_SERCOM2, false);
+    }
+    else
+    {
+        pm_enable_APB_clock(PM_CLK_SERCOM1, true);
+        pm_enable_APB_clock(PM_CLK_SERCOM2, true);
+        set_pressure_rate(PRESSURE_HZ);
+    }
+}
+
+// Called from the DMAC or SERCOM4 interrupt with the new key status
+static void on_keys(uint16_t new_keys)
+{
+    static int t = 1;
+
+    gpio_set_output(GPIO_PORT_B, 7, t);
+    t = !t;
+
+    if(usb_sleeping)
+    {
+        if(new_keys & ~keys) // Touch
+            wakeup();
+    }
+    else
+    {
+        toggle_drone(new_keys & ~keys);
+        if(octave > 0) // Was playing
+        {
+            unsigned int octave_modifier;
+            int new_note = keys_to_note(new_keys, &octave_modifier);
+            if(new_note >= 0)
+                new_note = note_to_midi_key(new_note, octave + octave_modifier);
+            else
+                dump(&new_keys, sizeof(new_keys));
+            replace_note(new_note);
+        }
+    }
+    keys = new_keys;
+}
+
+/* Sum of the half-hole and drift bends, only sent on change and at most
+ * PITCH_WHEEL_MAX_RATE_HZ times per second: a change that is held back is
+ * sent by a later call, as both keep being sampled
+ */
+static void update_pitch_wheel(void)
+{
+    int32_t wheel = PITCH_WHEEL_CENTER + half_hole_offset + drift_offset_now;
+    if(wheel < 0)
+        wheel = 0;
+    else if(wheel > PITCH_WHEEL_MAX)
+        wheel = PITCH_WHEEL_MAX;
+    // SysTick wraps within a second: pitch_wheel_time must not age past the interval
+    uint32_t now = systick_now();
+    systick_saturate(pitch_wheel_time, now, pitch_wheel_interval);
+    if(wheel == pitch_wheel)
+        return;
+    if(systick_elapsed(pitch_wheel_time, now) < pitch_wheel_interval)
+        return;
+    if(usb_midi_pitch_wheel_change(0, wheel))
+    {
+        pitch_wheel = wheel;
+        pitch_wheel_time = now;
+    }
+}
+
+/* Half-holing: the first open chanter hole bends the note down towards the
+ * note played with that hole covered, as long as it is within the wheel range
+ */
+static int16_t half_hole_bend(const struct atqt2120_signals_t *frame)
+{
+    size_t hole = 0;
+    while(hole < 7 && (keys & (1u << hole)))
+        ++hole;
+    if(hole == 7)
+        return 0;
+
+    unsigned int open_modifier, covered_modifier;
+    int open = keys_to_note(keys, &open_modifier);
+    int covered = keys_to_note(keys | (1u << hole), &covered_modifier);
+    if(open < 0 || covered < 0)
+        return 0;
+    int interval = note_to_midi_key(open, octave + open_modifier)
+                 - note_to_midi_key(covered, octave + covered_modifier);
+    if(interval <= 0 || interval > PITCH_BEND_RANGE)
+        return 0;
+
+    // Coverage / 256 instead of / ATQT2120_COVERAGE_FULL: no division
+    uint32_t coverage = atqt2120_coverage(frame, hole, &key_coverage[hole]);
+    return -(int16_t) ((coverage * interval * (PITCH_WHEEL_CENTER / PITCH_BEND_RANGE)) >> 8);
+}
+
+// Called from the SERCOM4 interrupt with every signal frame
+static void on_signals(const struct atqt2120_signals_t *frame)
+{
+    if(usb_sleeping)
+        return;
+
+    half_hole_offset = (octave > 0 ? half_hole_bend(frame) : 0);
+    update_pitch_wheel();
+}
+
+// Called from the DMAC or SERCOM0 interrupt with every pressure sample
+static void on_pressure(const struct abp_sample_t *sample)
+{
+#if KEYS_READ_DMA
+    // Same priority as the DMAC interrupt, periodic: catches stuck key reads
+    atqt2120_check_dma_reads();
+#endif
+
+    /* Notes are only sent from the note path (see nvic_set_priority(NVIC_DMAC / NVIC_TC3)),
+     * the note stays muted until the next note change
+     */
+    if(mute_requested)
+    {
+        mute_requested = false;
+        replace_note(-1);
+    }
+
+    // Thresholds are compared with the filtered pressure, at the control rate
+    uint16_t new_pressure;
+    if(sample->status != ABP_STATUS_FRESH || !filter_push(&pressure_filter, sample->pressure, &new_pressure))
+        return;
+
+    uint16_t old_pressure = pressure_history[pressure_history_index];
+    pressure_history[pressure_history_index] = new_pressure;
+    pressure_history_index = (pressure_history_index + 1) & (VELOCITY_LOOKBACK - 1);
+
+    // Before any note on, so that the note starts with the current breath
+    if(!usb_sleeping)
+        breath_update(new_pressure);
+
+    if(usb_sleeping)
+    {
+        // Notes are resynchronized after resume
+        if(new_pressure >= PRESSURE_OCT1)
+            wakeup();
+    }
+    else
+    {
+        uint8_t new_octave = octave_map_update(new_pressure);
+        if(octave == 0 && new_octave > 0) // Onset: the faster the rise, the louder
+        {
+            uint16_t step = (new_pressure > old_pressure ? new_pressure - old_pressure : 0) >> VELOCITY_SLOPE_SHIFT;
+            velocity = slope_to_velocity[step < sizeof(slope_to_velocity) ? step : sizeof(slope_to_velocity) - 1];
+        }
+        if(new_octave == 0)
+            replace_note(-1);
+        else if(new_octave != octave)
+        {
+            unsigned int octave_modifier;
+            int new_note = keys_to_note(keys, &octave_modifier);
+            new_note = note_to_midi_key(new_note, new_octave + octave_modifier);
+            replace_note(new_note);
+        }
+        octave = new_octave;
+    }
+
+    if(!usb_sleeping)
+    {
+        drift_offset_now = (drift ? drift_offset(drift, new_pressure) : 0);
+        update_pitch_wheel();
+    }
+}
+
+static bool button_pressed(void)
+{
+    return !gpio_read(GPIO_PORT_A, 8);
+}
+
+/* Calibration mode, entered when the button is held at power up.
+ * The highest signal drop of each key is measured without touch (noise),
+ * then while the player touches every key: the threshold goes halfway.
+ * Keys that were not touched keep their previous calibration.
+ */
+static void calibrate_keys(void)
+{
+    struct settings_t settings = {0};
+    const struct settings_t *saved = settings_get();
+    if(saved)
+        settings = *saved;
+
+    uint16_t noise[12] = {0};
+    uint16_t touch[12] = {0};
+    struct atqt2120_signals_t frame;
+
+    sercom_usart_puts(SERCOM_MIDI_CHANNEL, "\r\nCalibration: release the button, do not touch the keys");
+    while(button_pressed());
+    for(size_t n = 0; n < CALIBRATION_IDLE_FRAMES; ++n)
+    {
+        atqt2120_read_signals(&frame);
+        for(size_t i = 0; i < 12; ++i)
+        {
+            uint16_t delta = atqt2120_delta(&frame, i);
+            if(delta > noise[i])
+                noise[i] = delta;
+        }
+    }
+
+    sercom_usart_puts(SERCOM_MIDI_CHANNEL, "\r\nTouch every key, then press the button");
+    for(size_t n = 0; !button_pressed(); ++n)
+    {
+        gpio_set_output(GPIO_PORT_B, 7, (n >> 6) & 1);
+        atqt2120_read_signals(&frame);
+        for(size_t i = 0; i < 12; ++i)
+        {
+            uint16_t delta = atqt2120_delta(&frame, i);
+            if(delta > touch[i])
+                touch[i] = delta;
+        }
+    }
+    while(button_pressed());
+
+    uint8_t dthr[12];
+    for(size_t i = 0; i < 12; ++i)
+    {
+        if(touch[i] > noise[i] + 2 * CALIBRATION_MARGIN)
+        {
+            uint16_t threshold = noise[i] + (touch[i] - noise[i]) / 2;
+            settings.key_dthr[i] = (threshold > 255 ? 255 : threshold);
+            settings.key_full_delta[i] = touch[i];
+        }
+        dthr[i] = (settings.key_dthr[i] ? settings.key_dthr[i] : keys_config.keys[i].dthr);
+    }
+    atqt2120_set_thresholds(dthr);
+
+    bool saved_ok = settings_save(&settings);
+    sercom_usart_puts(SERCOM_MIDI_CHANNEL, saved_ok ? "\r\nCalibration saved" : "\r\nCalibration NOT saved");
+}
 
 void talabardine_init(void)
 {
@@ -211,16 +636,23 @@ void talabardine_init(void)
     // 37.12: NVM needs at least 1 wait state @48MHz when Vcc > 2.7v
     nvmctrl_set_wait_states(1);
     gclk_set_frequency(GCLK0, 48000000); // Main clock @48MHz
+    systick_init(); // USB-MIDI event timestamps
 
     pm_enable_APB_clock(PM_CLK_SERCOM0, true);
     pm_enable_APB_clock(PM_CLK_SERCOM1, true);
     pm_enable_APB_clock(PM_CLK_SERCOM2, true);
     pm_enable_APB_clock(PM_CLK_SERCOM4, true);
     pm_enable_APB_clock(PM_CLK_TC3, true);
+#if KEYS_SIGNAL_STREAMING
+    pm_enable_APB_clock(PM_CLK_TC4, true);
+#endif
+    pm_enable_APB_clock(PM_CLK_EVSYS, true);
 
     talabardine_init_gpios();
     talabardine_init_sercoms();
     
+    bool calibrate = button_pressed();
+
     gpio_set_output(GPIO_PORT_B, 7, true);
     sercom_usart_puts(SERCOM_MIDI_CHANNEL, "Press button to start");
     for(size_t i = 0; gpio_read(GPIO_PORT_A, 8); ++i)
@@ -234,73 +666,133 @@ void talabardine_init(void)
     nvic_enable(NVIC_SERCOM0 + SERCOM_KEYS_CHANNEL);
     interrupt_enable();
     atqt2120_init(&keys_config);
+    if(calibrate)
+        calibrate_keys();
+
+    const struct settings_t *settings = settings_get();
+    for(size_t i = 0; i < 12; ++i)
+        atqt2120_coverage_init(&key_coverage[i], settings && settings->key_dthr[i] ? settings->key_full_delta[i] : KEY_FULL_DELTA);
     keys = atqt2120_read_status();
     octave = 0;
-
-    /* Normally, EIC has higher (lower value) priority than SERCOM4 (keys), so we have to reverse
-     * priority in order, for the key handler, to be able to use interrupt-based I2C.
+    pitch_wheel = PITCH_WHEEL_CENTER;
+    pitch_wheel_time = systick_now();
+    pitch_wheel_interval = gclk_get_frequency(GCLK0) / PITCH_WHEEL_MAX_RATE_HZ;
+    half_hole_offset = 0;
+    drift_offset_now = 0;
+    drift_init(drift_cents_per_kpa, DRIFT_MINIMUM, DRIFT_REFERENCE);
+    filter_init(&pressure_filter, PRESSURE_OVERSAMPLING_SHIFT, PRESSURE_FILTER_IIR ? FILTER_IIR : FILTER_MOVING_AVERAGE,
+                PRESSURE_SMOOTHING_SHIFT, PRESSURE_DECIMATION, ABP_COUNT_MIN);
+    breath_init(&breath_config);
+    octave_map_set(octave_boundaries, sizeof(octave_boundaries) / sizeof(octave_boundaries[0]));
+    for(size_t i = 0; i < VELOCITY_LOOKBACK; ++i)
+        pressure_history[i] = ABP_COUNT_MIN;
+    pressure_history_index = 0;
+    velocity = 64;
+    mute_requested = false;
+    usb_sleeping = false;
+    low_power = false;
+
+    /* Both the key and the pressure handlers feed the USB-MIDI transmit ring,
+     * which only supports a single producer: they must not preempt each
+     * other, so they share the same priority.
+     * Keys are handled once their status is read, from the DMAC interrupt, or
+     * from the SERCOM4 interrupt (the key handler only queues the read).
      * Priority bits 5:0 are ignored so it starts with 64.
      */
+    nvic_set_priority(NVIC_DMAC, 64);
+    dmac_init();
+    evsys_init();
+    nvic_enable(NVIC_DMAC);
+
     nvic_set_priority(NVIC_EIC, 64);
+    nvic_set_priority(NVIC_SERCOM0 + SERCOM_KEYS_CHANNEL, 64);
     eic_init();
+#if KEYS_READ_DMA
+    atqt2120_start_dma_reads(EVSYS_GEN_EIC_EXTINT(EIC_KEYCHANGE), on_keys);
+    eic_enable_event(EIC_KEYCHANGE);
+#else
     eic_enable(EIC_KEYCHANGE);
     nvic_enable(NVIC_EIC);
+#endif
+#if KEYS_SIGNAL_STREAMING
+    nvic_set_priority(NVIC_TC4, 64);
+    tc_init(TC4, GCLK0, KEYS_SIGNAL_HZ);
+    nvic_clear(NVIC_TC4);
+    nvic_enable(NVIC_TC4);
+#endif
     
-    tc_init(TC3, GCLK0, 1000);
-    nvic_enable(NVIC_TC3);
+#if PRESSURE_SAMPLING_DMA
+    abp_start_sampling(EVSYS_GEN_TC3_OVF, on_pressure);
+#else
+    nvic_set_priority(NVIC_TC3, 64);
+    nvic_set_priority(NVIC_SERCOM0 + SERCOM_PRESSURE_CHANNEL, 64);
+    nvic_enable(NVIC_SERCOM0 + SERCOM_PRESSURE_CHANNEL);
+#endif
+    set_pressure_rate(PRESSURE_HZ);
 
     usb_talabardine_init();
+    udc_register_suspend_callback(on_usb_suspend);
     usb_midi_init();
+    usb_midi_set_sof_sync(USB_MIDI_SOF_SYNC);
     nvic_enable(NVIC_USB);
 }
 
+// Handles the MIDI messages received from the host, outside of any interrupt
+void talabardine_poll(void)
+{
+    uint8_t message[3];
+    size_t size;
+    while((size = usb_midi_receive(message, NULL)))
+    {
+        // All Sound Off, All Notes Off
+        if(size == 3 && (message[0] & 0xf0) == 0xb0 && (message[1] == 120 || message[1] == 123))
+            mute_requested = true;
+    }
+
+    if(usb_sleeping != low_power)
+        set_low_power(usb_sleeping);
+
+    // Interrupts are disabled so that a resume cannot slip in before WFI
+    interrupt_disable();
+    if(usb_sleeping)
+        pm_idle(PM_IDLE_CPU);
+    interrupt_enable();
+}
+
+// Only used without KEYS_READ_DMA
 void keychange_handler(void)
 {
-    static int t = 1;
-    
     eic_clear(EIC_KEYCHANGE);
     nvic_clear(NVIC_EIC);
-    
-    gpio_set_output(GPIO_PORT_B, 7, t);
-    t = !t;
 
-    uint8_t new_keys = atqt2120_read_status(); // Reads AND acknowledges the interrupt on the ATQT2120 side
-    if(octave > 0) // Was playing
-    {
-        unsigned int octave_modifier;
-        int new_note = keys_to_note(new_keys, &octave_modifier);
-        if(new_note >= 0)
-            new_note = note_to_midi_key(new_note, octave + octave_modifier);
-        else
-            dump(&new_keys, 1);
-        replace_note(new_note);
-    }
-    keys = new_keys;
+    // Reads AND acknowledges the interrupt on the ATQT2120 side, see on_keys
+    atqt2120_request_status(on_keys);
 }
 
+// Only used with KEYS_SIGNAL_STREAMING
+void keysignal_handler(void)
+{
+    tc_clear_interrupt(TC4);
+    nvic_clear(NVIC_TC4);
+
+    // Skipped if the previous frame is not complete yet
+    atqt2120_request_signals(KEYS_CHANTER, on_signals);
+}
+
+// Only used without PRESSURE_SAMPLING_DMA
 void pressure_handler(void)
 {
     tc_clear_interrupt(TC3);
     nvic_clear(NVIC_TC3);
 
-    uint16_t new_pressure = abp_wait_until_valid_pressure();
-    if(new_pressure >= PRESSURE_OCT1)
-    {
-        uint8_t new_octave = (new_pressure >= PRESSURE_OCT2 ? 2 : 1);
-        if(new_octave != octave)
-        {
-            unsigned int octave_modifier;
-            int new_note = keys_to_note(keys, &octave_modifier);
-            new_note = note_to_midi_key(new_note, new_octave + octave_modifier);
-            replace_note(new_note);
-            octave = new_octave;
-        }
-    }
-    else
-    {
-        octave = 0;
-        replace_note(-1);
-    }
+    // Skipped if the bus is still busy with the previous sample
+    abp_request_pressure(on_pressure);
+}
+
+void sercom0_handler(void) // pressure spi
+{
+    nvic_clear(NVIC_SERCOM0);
+    sercom_spi_interrupt(0);
 }
 
 void sercom4_handler(void) // keys i2c
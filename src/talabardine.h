@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 void talabardine_init(void);
+void talabardine_poll(void);
 uint16_t talabardine_get_pressure(void);
 
 #endif
@@ -93,3 +93,17 @@ void tc_clear_interrupt(enum tc_channel_e channel)
     tc8b->intflag = (1 << 0); // Ack overflow interrupt
 }
 
+
+// Overflow event output, e.g. to start a DMA transfer through the EVSYS
+void tc_enable_overflow_event(enum tc_channel_e channel, bool enable)
+{
+    volatile struct tc8b_t *tc8b = TC8BIT(channel);
+    uint16_t ctrla = tc8b->ctrla;
+
+    // Only written while the TC is disabled
+    tc8b->ctrla = ctrla & ~(1 << 1);
+    while(tc8b->status & STATUS_SYNCBUSY);
+    uint16_t evctrl = tc8b->evctrl & ~(1 << 8);
+    tc8b->evctrl = evctrl | (enable << 8); // OVFEO
+    tc8b->ctrla = ctrla;
+}
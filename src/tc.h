@@ -17,6 +17,7 @@ enum tc_channel_e
 
 bool tc_init(enum tc_channel_e channel, enum gclk_channel_e gclk_src, uint32_t frequency_hz);
 void tc_clear_interrupt(enum tc_channel_e channel);
+void tc_enable_overflow_event(enum tc_channel_e channel, bool enable);
 
 #endif
 
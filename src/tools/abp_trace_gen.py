@@ -0,0 +1,42 @@
+import math
+import random
+import sys
+
+# ABP trace in the shape of a breath record, for src/tools/filter_test.c:
+# one 14-bit count per line, sampled at 1 kHz. A trace recorded on the device
+# (one count per line as well) can be given to filter_test instead.
+
+RATE_HZ = 1000
+COUNT_MIN = 0x0666 # 0 Pa
+COUNTS_PER_PA = (0x399a - 0x0666) / (93078 - 10342)
+NOISE = 3 # Counts, peak
+
+# (start s, attack s, hold s, release s, pressure Pa)
+BREATHS = [
+    (0.20, 0.080, 0.60, 0.100, 2500),
+    (1.10, 0.015, 0.30, 0.050, 4000), # Sharp attack
+    (1.60, 0.200, 0.80, 0.300, 1500),
+    (3.00, 0.030, 0.05, 0.030, 3000), # Short note
+    (3.30, 0.050, 0.50, 0.080, 4800),
+]
+DURATION = 4.2 # s
+
+def pressure(t):
+    p = 0
+    for start, attack, hold, release, peak in BREATHS:
+        x = t - start
+        if x < 0:
+            continue
+        if x < attack:
+            p += peak * x / attack
+        elif x < attack + hold:
+            # Some vibrato while holding
+            p += peak * (1 + 0.03 * math.sin(2 * math.pi * 5 * (x - attack)))
+        elif x < attack + hold + release:
+            p += peak * (1 - (x - attack - hold) / release)
+    return p
+
+random.seed(int(sys.argv[1]) if len(sys.argv) > 1 else 1)
+for i in range(int(DURATION * RATE_HZ)):
+    count = COUNT_MIN + pressure(i / RATE_HZ) * COUNTS_PER_PA + random.uniform(-NOISE, NOISE)
+    print(min(0x3fff, max(0, round(count))))
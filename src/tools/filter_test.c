@@ -0,0 +1,215 @@
+/*
+ * Host test of src/filter.c: runs filter_push over an ABP trace (one count
+ * per line) for every parameter set, compares each output with a floating
+ * point reference of the same filter, and reports the cost per sample.
+ * Host timings only give the relative cost of the parameter sets, the
+ * firmware runs on a Cortex-M0.
+ *     filter_test trace
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAS_TSC 1
+#else
+#define HAS_TSC 0
+#endif
+
+#include "filter.h"
+#include "config.h"
+
+#define MAX_SAMPLES 100000
+#define MAX_ERROR 1.0 // Counts: output rounding and fixed point truncation
+#define TIMING_RUNS 200
+
+static uint16_t samples[MAX_SAMPLES];
+static size_t n_samples;
+
+struct reference_t
+{
+    uint8_t oversampling_shift;
+    enum filter_smoothing_e smoothing;
+    uint8_t smoothing_shift;
+    uint8_t decimation;
+
+    double sum;
+    unsigned summed;
+    double value;
+    double ring[1 << FILTER_MAX_SHIFT];
+    unsigned ring_index;
+    unsigned decimated;
+};
+
+static void reference_init(struct reference_t *r, uint8_t oversampling_shift, enum filter_smoothing_e smoothing, uint8_t smoothing_shift, uint8_t decimation, uint16_t initial)
+{
+    r->oversampling_shift = oversampling_shift;
+    r->smoothing = smoothing;
+    r->smoothing_shift = smoothing_shift;
+    r->decimation = decimation;
+    r->sum = 0;
+    r->summed = 0;
+    r->value = initial;
+    for(size_t i = 0; i < (1u << FILTER_MAX_SHIFT); ++i)
+        r->ring[i] = initial;
+    r->ring_index = 0;
+    r->decimated = 0;
+}
+
+static int reference_push(struct reference_t *r, uint16_t sample, double *output)
+{
+    unsigned oversampling = (1u << r->oversampling_shift);
+    unsigned length = (1u << r->smoothing_shift);
+
+    r->sum += sample;
+    if(++r->summed < oversampling)
+        return 0;
+    double x = r->sum / oversampling;
+    r->sum = 0;
+    r->summed = 0;
+
+    if(r->smoothing == FILTER_IIR)
+        r->value += (x - r->value) / length;
+    else
+    {
+        r->ring[r->ring_index] = x;
+        r->ring_index = (r->ring_index + 1) % length;
+        double sum = 0;
+        for(size_t i = 0; i < length; ++i)
+            sum += r->ring[i];
+        r->value = sum / length;
+    }
+
+    if(++r->decimated < r->decimation)
+        return 0;
+    r->decimated = 0;
+    *output = r->value;
+    return 1;
+}
+
+static int load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if(!f)
+    {
+        perror(path);
+        return 0;
+    }
+    unsigned count;
+    while(n_samples < MAX_SAMPLES && fscanf(f, "%u", &count) == 1)
+        samples[n_samples++] = count;
+    fclose(f);
+    return n_samples > 0;
+}
+
+// Returns the largest error, in counts, -1 if the outputs do not line up
+static double compare(uint8_t oversampling_shift, enum filter_smoothing_e smoothing, uint8_t smoothing_shift, uint8_t decimation)
+{
+    struct filter_t filter;
+    struct reference_t reference;
+    if(!filter_init(&filter, oversampling_shift, smoothing, smoothing_shift, decimation, samples[0]))
+        return -1;
+    reference_init(&reference, oversampling_shift, smoothing, smoothing_shift, decimation, samples[0]);
+
+    double max_error = 0;
+    for(size_t i = 0; i < n_samples; ++i)
+    {
+        uint16_t output;
+        double expected;
+        int ready = filter_push(&filter, samples[i], &output);
+        if(ready != reference_push(&reference, samples[i], &expected))
+            return -1;
+        if(ready && fabs(output - expected) > max_error)
+            max_error = fabs(output - expected);
+    }
+    return max_error;
+}
+
+static double now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static void timing(uint8_t oversampling_shift, enum filter_smoothing_e smoothing, uint8_t smoothing_shift, uint8_t decimation)
+{
+    struct filter_t filter;
+    volatile uint16_t sink = 0;
+    filter_init(&filter, oversampling_shift, smoothing, smoothing_shift, decimation, samples[0]);
+
+    double start = now_ns();
+#if HAS_TSC
+    uint64_t start_cycles = __rdtsc();
+#endif
+    for(size_t run = 0; run < TIMING_RUNS; ++run)
+    {
+        for(size_t i = 0; i < n_samples; ++i)
+        {
+            uint16_t output;
+            if(filter_push(&filter, samples[i], &output))
+                sink = output;
+        }
+    }
+#if HAS_TSC
+    double cycles = (double) (__rdtsc() - start_cycles) / (TIMING_RUNS * n_samples);
+#endif
+    double ns = (now_ns() - start) / (TIMING_RUNS * n_samples);
+    (void) sink;
+
+    printf("os %u %s %u dec %u: %.2f ns/sample", oversampling_shift, smoothing == FILTER_IIR ? "iir" : "ma ", smoothing_shift, decimation, ns);
+#if HAS_TSC
+    printf(", %.1f host cycles/sample", cycles);
+#endif
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 2 || !load(argv[1]))
+    {
+        fprintf(stderr, "usage: %s trace\n", argv[0]);
+        return 2;
+    }
+
+    static const uint8_t decimations[] = {1, 2, 4};
+    int failed = 0;
+    double worst = 0;
+    for(uint8_t os = 0; os <= FILTER_MAX_SHIFT; ++os)
+    {
+        for(int smoothing = FILTER_IIR; smoothing <= FILTER_MOVING_AVERAGE; ++smoothing)
+        {
+            for(uint8_t shift = 0; shift <= FILTER_MAX_SHIFT; ++shift)
+            {
+                for(size_t d = 0; d < sizeof(decimations); ++d)
+                {
+                    double error = compare(os, smoothing, shift, decimations[d]);
+                    if(error < 0 || error > MAX_ERROR)
+                    {
+                        printf("FAIL os %u %s %u dec %u: ", os, smoothing == FILTER_IIR ? "iir" : "ma", shift, decimations[d]);
+                        if(error < 0)
+                            printf("outputs do not line up\n");
+                        else
+                            printf("error %.3f counts\n", error);
+                        failed = 1;
+                    }
+                    else if(error > worst)
+                        worst = error;
+                }
+            }
+        }
+    }
+    if(failed)
+        printf("%zu samples, FAILED\n", n_samples);
+    else
+        printf("%zu samples, largest error %.3f counts\n", n_samples, worst);
+
+    // Firmware settings first
+    timing(PRESSURE_OVERSAMPLING_SHIFT, PRESSURE_FILTER_IIR ? FILTER_IIR : FILTER_MOVING_AVERAGE, PRESSURE_SMOOTHING_SHIFT, PRESSURE_DECIMATION);
+    timing(0, FILTER_IIR, 0, 1);
+    timing(FILTER_MAX_SHIFT, FILTER_IIR, FILTER_MAX_SHIFT, 1);
+    timing(FILTER_MAX_SHIFT, FILTER_MOVING_AVERAGE, FILTER_MAX_SHIFT, 1);
+    return failed;
+}
@@ -14,8 +14,12 @@ NAMES = {
 }
 HANDLERS = {
     4  : "keychange_handler",
+    6  : "dmac_handler",
     7  : "usb_handler",
-    18 : "pressure_handler"
+    9  : "sercom0_handler",
+    13 : "sercom4_handler",
+    18 : "pressure_handler",
+    19 : "keysignal_handler"
 }
 
 def irq2label(irq):
@@ -4,6 +4,7 @@
 
 #include "udc.h"
 #include "nvic.h"
+#include "interrupt.h"
 #include "usb.h"
 #include "gclk.h"
 #include "nvm.h"
@@ -16,6 +17,14 @@
 // -> control buffers <= 64 bytes
 #define EP_BUFFER_SIZE 128
 
+/* Buffers of the other OUT endpoints are made of fixed-size blocks,
+ * allocated according to wMaxPacketSize when the endpoints are configured.
+ * IN endpoints need none: they send the caller's buffer, see udc_tx_submit.
+ */
+#define ARENA_BLOCK_SHIFT 6
+#define ARENA_BLOCK_SIZE (1 << ARENA_BLOCK_SHIFT) // Largest full-speed bulk packet
+#define ARENA_BLOCKS 8
+
 #define USB ((volatile struct usb_device_t*) 0x41005000)
 #define _ENDPOINT0 (0x41005100)
 #define _ENDPOINT(x) (_ENDPOINT0 + ((x) << 5))
@@ -23,7 +32,14 @@
 
 #define NENDPOINTS 8
 
+// Application and USB MIDI
+#define MAX_SUSPEND_CALLBACKS 2
+
+// Must match bMaxPacketSize of the device descriptor
+#define EP0_PACKET_SIZE 64
+
 #define CTRLB_DETACH (1 << 0)
+#define CTRLB_UPRSM (1 << 1)
 
 #define SYNCBUSY_SWRST  (1 << 0)
 #define SYNCBUSY_ENABLE (1 << 1)
@@ -34,6 +50,9 @@
 #define INTFLAG_WAKEUP (1 << 4)
 #define INTFLAG_EORSM (1 << 5)
 
+#define FNUM_FNUM(x) (((x) >> 3) & 0x7ff)
+#define FNUM_FNCERR (1 << 15)
+
 #define EPINTFLAG_TRCPT0  (1 << 0)
 #define EPINTFLAG_TRCPT1  (1 << 1)
 #define EPINTFLAG_TRFAIL0 (1 << 2)
@@ -44,10 +63,16 @@
 
 #define EPSTATUS_DTGLOUT (1 << 0)
 #define EPSTATUS_DTGLIN (1 << 1)
+#define EPSTATUS_CURBK (1 << 2)
 #define EPSTATUS_STALLRQ1 (1 << 5)
 #define EPSTATUS_BK0RDY (1 << 6)
 #define EPSTATUS_BK1RDY (1 << 7)
 
+#define PCKSIZE_SIZE_MASK (0x7 << 28)
+// 32.8.7.2: SIZE field of PCKSIZE, for 8 to 64 byte packets
+#define PCKSIZE_SIZE(bytes) (((bytes) <= 8 ? 0x0 : (bytes) <= 16 ? 0x1 : (bytes) <= 32 ? 0x2 : 0x3) << 28)
+#define EP0_PCKSIZE PCKSIZE_SIZE(EP0_PACKET_SIZE)
+
 struct __attribute__((packed)) usb_device_endpoint_register_t
 {
     uint8_t epcfg;
@@ -112,15 +137,38 @@ struct __attribute__((packed)) usb_descriptor_t
 static volatile struct usb_descriptor_t __attribute__((aligned(4))) descriptors[NENDPOINTS];
 static volatile uint8_t __attribute__((aligned(4))) buf0[EP_BUFFER_SIZE];
 static volatile uint8_t __attribute__((aligned(4))) buf1[EP_BUFFER_SIZE];
+static uint32_t arena[ARENA_BLOCKS][ARENA_BLOCK_SIZE / sizeof(uint32_t)];
 
 static struct
 {
-    void (*receive_callbacks[NENDPOINTS-1])(void);
+    void (*receive_callbacks[NENDPOINTS-1])(const volatile uint8_t *data, size_t size);
     void (*send_callbacks[NENDPOINTS-1])(void);
+    volatile bool send_requests[NENDPOINTS-1];
+    void (*sof_callback)(uint16_t frame);
+    void (*suspend_callbacks[MAX_SUSPEND_CALLBACKS])(bool suspended);
+    void (*reset_callback)(void);
+
+    // Bit i set: endpoint i uses both banks (ping-pong) in a single direction
+    uint8_t dual_bank;
+    uint8_t dual_in;
+    uint8_t dual_out;
+    uint8_t next_bank[NENDPOINTS]; // IN: next bank to fill, OUT: next bank to read
+    uint8_t configured_in; // Bit i set: IN endpoint i is configured
+    bool tx_acquired[NENDPOINTS]; // The next IN bank belongs to the caller of udc_tx_acquire
+    uint8_t arena_used; // Blocks
     
     uint8_t last_address;
     bool suspended;
     struct udc_control_callback pending_control;
+
+    // Data stage of the current control IN transfer
+    struct
+    {
+        const uint8_t *data;
+        size_t remaining;
+        bool zlp; // A zero-length packet must end the data stage
+        bool active;
+    } control_in;
 } context;
 
 static void endpoint_reset(uint8_t ep, enum endpoint_direction_e direction)
@@ -153,21 +201,32 @@ static void async_wait_for_ep(uint8_t ep, uint8_t epintmask)
     endpoint->epintenset = epintmask;
 }
 
+static void set_suspended(bool suspended)
+{
+    if(suspended == context.suspended)
+        return;
+    context.suspended = suspended;
+    for(size_t i = 0; i < MAX_SUSPEND_CALLBACKS; ++i)
+        if(context.suspend_callbacks[i])
+            context.suspend_callbacks[i](suspended);
+}
+
 static void udc_reset(void)
 {
     volatile struct usb_device_endpoint_register_t *endpoint0 = ENDPOINT(0);
 
     udc_endpoint_unconfigure();
     
-    context.suspended = false;
+    set_suspended(false);
     context.pending_control.type = UDC_CONTROL_NONE;
+    context.control_in.active = false;
 
     endpoint0->epcfg = 0x11; // Control OUT, Control OUT
     descriptors[0].banks[0].addr = (uint32_t) &buf0[0];
-    descriptors[0].banks[0].pcksize = (0x3 << 28); // 64 bytes
+    descriptors[0].banks[0].pcksize = EP0_PCKSIZE;
 
     descriptors[0].banks[1].addr = (uint32_t) &buf1[0];
-    descriptors[0].banks[1].pcksize = (0x3 << 28); // 64 bytes
+    descriptors[0].banks[1].pcksize = EP0_PCKSIZE;
 
     USB->dadd = (1 << 7) // ADDEN
               | context.last_address
@@ -175,42 +234,132 @@ static void udc_reset(void)
 
     endpoint0->epstatusclr = EPSTATUS_DTGLOUT | EPSTATUS_DTGLIN | EPSTATUS_BK0RDY |EPSTATUS_BK1RDY;
     async_wait_for_ep(0, EPINTFLAG_RXSTP);
+
+    if(context.reset_callback)
+        context.reset_callback();
 }
 
-void udc_endpoint_configure(const struct usb_endpoint_descriptor_t *descriptor)
+// Returns a buffer of at least size bytes from the arena, NULL if exhausted
+static void *arena_alloc(uint16_t size)
+{
+    uint8_t n = ((size + ARENA_BLOCK_SIZE - 1) >> ARENA_BLOCK_SHIFT);
+    if(!n || context.arena_used + n > ARENA_BLOCKS)
+        return NULL;
+    void *buffer = arena[context.arena_used];
+    context.arena_used += n;
+    return buffer;
+}
+
+/* Returns false if the arena cannot hold the buffers of the OUT endpoint,
+ * which is then left unconfigured
+ */
+bool udc_endpoint_configure(const struct usb_endpoint_descriptor_t *descriptor)
 {
     uint8_t ep = (descriptor->bEndpointAddress & 0x7f);
     uint8_t directionIn = (descriptor->bEndpointAddress & 0x80);
     uint8_t transferType = (descriptor->bmAttributes & 0x3);
     volatile struct usb_device_endpoint_register_t *endpoint = ENDPOINT(ep);
+    // Only isochronous and bulk endpoints can be dual bank
+    bool dual = ((context.dual_bank & (1 << ep)) && (transferType == 1 || transferType == 2));
 
     // wMaxPacketSize might be misaligned
     const uint8_t *psize = (const uint8_t*) &descriptor->wMaxPacketSize;
     uint16_t size_l = psize[0];
     uint16_t size_h = (psize[1] & 0x03);
     uint16_t size = size_l | (size_h << 8);
+
+    // Each OUT bank in use gets its own buffer
+    if(!directionIn)
+    {
+        uint8_t arena_used = context.arena_used;
+        void *buffer = arena_alloc(size);
+        void *buffer_other = (dual ? arena_alloc(size) : NULL);
+        if(!buffer || (dual && !buffer_other))
+        {
+            context.arena_used = arena_used; // Rolled back
+            return false;
+        }
+        descriptors[ep].banks[0].addr = (uint32_t) buffer;
+        if(dual)
+            descriptors[ep].banks[1].addr = (uint32_t) buffer_other;
+    }
     
     endpoint_reset(ep, directionIn);
 
     // Configure endpoint transfer type
     uint8_t epcfg = endpoint->epcfg;
-    epcfg &= (0x07 << (directionIn ? 0 : 4));
+    if(dual)
+    {
+        /* 32.8.3.1: the bank of the other direction is borrowed, its EPTYPE
+         * is set to "dual bank" (0x5)
+         */
+        endpoint_reset(ep, !directionIn);
+        epcfg = (0x5 << (directionIn ? 0 : 4));
+        endpoint->epstatusclr = EPSTATUS_CURBK;
+    }
+    else
+        epcfg &= (0x07 << (directionIn ? 0 : 4));
     epcfg |= ((transferType + 1) << (directionIn ? 4 : 0));
     endpoint->epcfg = epcfg;
 
+    // Compute driver's packet size
+    size_t log2_size = 0;
+    for(size_t s = (size >> 3); s && log2_size <= 7; ++log2_size, s >>= 1);
+    --log2_size;
+    uint32_t pcksize = (log2_size << 28);
+
     if(!directionIn)
     {
-        // Compute driver's packet size
-        size_t log2_size = 0;
-        for(size_t s = (size >> 3); s && log2_size <= 7; ++log2_size, s >>= 1);
-        --log2_size;
-        uint32_t pcksize = (log2_size << 28);
-        
         descriptors[ep].banks[0].pcksize = pcksize | size;
-        endpoint->epstatusclr = EPSTATUS_BK0RDY;
-        async_wait_for_ep(ep, EPINTFLAG_TRCPT0 | EPINTFLAG_TRFAIL0);
+        if(dual)
+        {
+            /* Both banks are handed to the hardware: it keeps receiving in
+             * one bank while the other one is being read
+             */
+            descriptors[ep].banks[1].pcksize = pcksize | size;
+            endpoint->epstatusclr = EPSTATUS_BK0RDY | EPSTATUS_BK1RDY;
+            async_wait_for_ep(ep, EPINTFLAG_TRCPT0 | EPINTFLAG_TRCPT1);
+            context.dual_out |= (1 << ep);
+        }
+        else
+        {
+            endpoint->epstatusclr = EPSTATUS_BK0RDY;
+            async_wait_for_ep(ep, EPINTFLAG_TRCPT0 | EPINTFLAG_TRFAIL0);
+            context.dual_out &= ~(1 << ep);
+        }
+        context.next_bank[ep] = 0;
+    }
+    else
+    {
+        // Packets larger than wMaxPacketSize are split by the hardware
+        descriptors[ep].banks[1].pcksize = pcksize;
+        if(dual)
+        {
+            descriptors[ep].banks[0].pcksize = pcksize;
+            context.dual_in |= (1 << ep);
+        }
+        else
+            context.dual_in &= ~(1 << ep);
+        context.next_bank[ep] = 0;
+        context.tx_acquired[ep] = false;
+        context.configured_in |= (1 << ep);
     }
-    // If direction IN, do nothing
+    return true;
+}
+
+/* Makes the endpoint use both banks for its single direction (ping-pong), so
+ * that one bank can be filled while the other one is being transferred.
+ * Takes effect at the next udc_endpoint_configure. OUT endpoints need a buffer
+ * for each bank.
+ */
+void udc_endpoint_set_dual_bank(uint8_t ep, bool enable)
+{
+    if(ep < 1 || ep >= NENDPOINTS)
+        return;
+    if(enable)
+        context.dual_bank |= (1 << ep);
+    else
+        context.dual_bank &= ~(1 << ep);
 }
 
 void udc_dump_endpoint(uint8_t ep)
@@ -229,18 +378,20 @@ void udc_dump_endpoint(uint8_t ep)
 
 void udc_endpoint_unconfigure(void)
 {
+    context.dual_in = 0;
+    context.dual_out = 0;
+    context.arena_used = 0;
+    context.configured_in = 0;
     for(size_t i = 1; i < NENDPOINTS; ++i)
     {
         endpoint_reset(i, ENDPOINT_OUT);
         endpoint_reset(i, ENDPOINT_IN);
+        descriptors[i].banks[0].addr = 0;
+        descriptors[i].banks[1].addr = 0;
+        context.tx_acquired[i] = false;
     }
 }
 
-void udc_endpoint_set_buffer(uint8_t ep, enum endpoint_direction_e direction, volatile void *buffer)
-{
-    descriptors[ep].banks[direction].addr = (uint32_t) buffer;
-}
-
 void udc_attach(void)
 {
     USB->ctrlb &= ~CTRLB_DETACH;
@@ -293,55 +444,166 @@ void udc_init(void)
     context.last_address = 0;
     udc_reset();
 
-    USB->intflag = INTFLAG_EORST;
-    USB->intenset = INTFLAG_EORST;
+    USB->intflag = INTFLAG_EORST | INTFLAG_SUSPEND | INTFLAG_WAKEUP | INTFLAG_EORSM;
+    USB->intenset = INTFLAG_EORST | INTFLAG_SUSPEND | INTFLAG_WAKEUP | INTFLAG_EORSM;
 }
 
-void udc_tx(uint8_t ep, const void *data, size_t size)
+// Copies whole words whenever the source allows it; dst must be word-aligned
+static void copy_to_buffer(volatile uint8_t *dst, const void *src, size_t size)
 {
-    volatile struct usb_device_endpoint_register_t *endpoint = ENDPOINT(ep);
-    volatile struct usb_device_bank_t *bank = &descriptors[ep].banks[1];
-
-    if(data == NULL)
-        size = 0;
-    else if(data >= (const void*) 0x20000000 && data < (const void*) 0x20004000 && (((uint32_t) data) & 0x3) == 0)
-        bank->addr = (uint32_t) data;
-    else
-#if 0
+    const uint8_t *ptr = src;
+    if((((uint32_t) ptr) & 0x3) == 0)
     {
-        volatile void *dst = buf1;
-        memcpy(dst, data, size);
+        volatile uint32_t *wdst = (volatile uint32_t*) dst;
+        const uint32_t *wsrc = (const uint32_t*) ptr;
+        for(; size >= 4; size -= 4)
+            *wdst++ = *wsrc++;
+        dst = (volatile uint8_t*) wdst;
+        ptr = (const uint8_t*) wsrc;
     }
-#else
+    while(size--)
+        *dst++ = *ptr++;
+}
+
+// Dual bank endpoints alternate between both banks, in the hardware's order
+static uint8_t tx_bank(uint8_t ep)
+{
+    return ((context.dual_in & (1 << ep)) ? context.next_bank[ep] : 1);
+}
+
+/* Reserves the next IN bank of the endpoint for udc_tx_submit. Returns false
+ * if the bank is still owned by the hardware, or if the endpoint is not
+ * configured. Until it is submitted or released, the bank stays reserved.
+ */
+bool udc_tx_acquire(uint8_t ep)
+{
+    if(ep < 1 || ep >= NENDPOINTS || !(context.configured_in & (1 << ep)))
+        return false;
+
+    uint8_t b = tx_bank(ep);
+    if(!context.tx_acquired[ep])
     {
-        volatile uint8_t *dst = buf1;
-        const uint8_t *ptr = data;
-        size_t s = size;
-        while(s--)
-            *dst++ = *ptr++;
-        bank->addr = (uint32_t) buf1;
+        if(ENDPOINT(ep)->epstatus & (EPSTATUS_BK0RDY << b))
+            return false;
+        context.tx_acquired[ep] = true;
     }
-#endif
-    uint32_t pcksize = bank->pcksize;
-    pcksize &= 0xffffc000;
+    return true;
+}
+
+/* Sends data from the bank reserved by udc_tx_acquire, without any copy
+ * data: word-aligned RAM buffer, left untouched until udc_tx_pending tells
+ *       the bank is gone (NULL for a ZLP)
+ * size: bytes to send, at most wMaxPacketSize, 0 for a ZLP
+ * Returns false if no bank was acquired
+ */
+bool udc_tx_submit(uint8_t ep, const void *data, size_t size)
+{
+    if(ep < 1 || ep >= NENDPOINTS || !context.tx_acquired[ep])
+        return false;
+    context.tx_acquired[ep] = false;
+
+    volatile struct usb_device_endpoint_register_t *endpoint = ENDPOINT(ep);
+    uint8_t b = tx_bank(ep);
+    volatile struct usb_device_bank_t *bank = &descriptors[ep].banks[b];
+    bank->addr = (uint32_t) data;
+    bank->pcksize = (bank->pcksize & PCKSIZE_SIZE_MASK) | size;
+
+    compiler_barrier(); // The data must be complete before the hardware reads it
+    async_wait_for_ep(ep, EPINTFLAG_TRCPT0 << b);
+    endpoint->epstatusset = EPSTATUS_BK0RDY << b;
+    context.next_bank[ep] = b ^ 1;
+    return true;
+}
+
+// Gives the bank reserved by udc_tx_acquire back without sending it
+void udc_tx_release(uint8_t ep)
+{
+    if(ep < 1 || ep >= NENDPOINTS)
+        return;
+    context.tx_acquired[ep] = false;
+}
+
+// Returns the number of IN banks of the endpoint that are still waiting for the host
+uint8_t udc_tx_pending(uint8_t ep)
+{
+    uint8_t epstatus = ENDPOINT(ep)->epstatus;
+    uint8_t pending = ((epstatus & EPSTATUS_BK1RDY) ? 1 : 0);
+    if(context.dual_in & (1 << ep))
+        pending += ((epstatus & EPSTATUS_BK0RDY) ? 1 : 0);
+    return pending;
+}
+
+// Returns how many transfers the endpoint can hold at once
+uint8_t udc_tx_banks(uint8_t ep)
+{
+    return ((context.dual_in & (1 << ep)) ? 2 : 1);
+}
+
+/* Asks for the send callback of the endpoint to be called from the USB
+ * interrupt as soon as the endpoint can accept a new transfer. Safe to call
+ * from any interrupt priority, as long as it is lower than the USB's one.
+ */
+void udc_request_send(uint8_t ep)
+{
+    if(ep < 1)
+        return;
+    context.send_requests[ep - 1] = true;
+    nvic_set_pending(NVIC_USB);
+}
+
+// Sends the next packet of the data stage of the current control IN transfer
+static void control_in_next(void)
+{
+    size_t size = context.control_in.remaining;
     if(size == 0)
-        pcksize |= (1 << 31);
-    else
-        pcksize |= size;
-    bank->pcksize = pcksize;
-    
-    if(ep == 0)
-        async_wait_for_ep(ep, EPINTFLAG_TRCPT1 | EPINTFLAG_TRFAIL1);
-    else
-        async_wait_for_ep(ep, EPINTFLAG_TRCPT1);
-    endpoint->epstatusset = EPSTATUS_BK1RDY;
+    {
+        if(!context.control_in.zlp)
+        {
+            // Data stage complete, the host now sends the status stage
+            context.control_in.active = false;
+            return;
+        }
+        context.control_in.zlp = false;
+    }
+    else if(size > EP0_PACKET_SIZE)
+        size = EP0_PACKET_SIZE;
+
+    copy_to_buffer(buf1, context.control_in.data, size);
+    context.control_in.data += size;
+    context.control_in.remaining -= size;
+
+    descriptors[0].banks[1].addr = (uint32_t) buf1;
+    descriptors[0].banks[1].pcksize = EP0_PCKSIZE | size;
+    async_wait_for_ep(0, EPINTFLAG_TRCPT1 | EPINTFLAG_TRFAIL1);
+    ENDPOINT(0)->epstatusset = EPSTATUS_BK1RDY;
+}
+
+/* Starts the data stage of a control IN transfer, sent in EP0_PACKET_SIZE
+ * packets
+ * size: size of data
+ * length: wLength of the setup packet, data is truncated to it
+ */
+void udc_control_tx(const void *data, size_t size, size_t length)
+{
+    if(size > length)
+        size = length;
+
+    context.control_in.data = data;
+    context.control_in.remaining = size;
+    /* The host considers the data stage over when it receives either wLength
+     * bytes or a short packet: if the data ends on a packet boundary before
+     * wLength, a zero-length packet must follow.
+     */
+    context.control_in.zlp = (size < length || size == 0) && (size & (EP0_PACKET_SIZE - 1)) == 0;
+    context.control_in.active = true;
+    control_in_next();
 }
 
 void udc_control_send(const struct udc_control_callback *cb)
 {
     volatile struct usb_device_endpoint_register_t *endpoint0 = ENDPOINT(0);
     context.pending_control = *cb;
-    descriptors[0].banks[1].pcksize = (0x3 << 28)
+    descriptors[0].banks[1].pcksize = EP0_PCKSIZE
                                     | (1 << 31) // AUTO_ZLP
                                     ;
     endpoint0->epstatusset = EPSTATUS_BK1RDY;
@@ -376,7 +638,7 @@ void udc_stall(uint8_t ep)
     ENDPOINT(ep)->epstatusset = EPSTATUS_STALLRQ1;
 }
 
-void udc_register_receive_callback(uint8_t ep, void (*callback)(void))
+void udc_register_receive_callback(uint8_t ep, void (*callback)(const volatile uint8_t *data, size_t size))
 {
     if(ep < 1)
         return;
@@ -395,6 +657,86 @@ bool udc_is_suspended(void)
     return context.suspended;
 }
 
+// Hands a received OUT bank to the receive callback, then gives it back to the hardware
+static void receive_bank(uint8_t ep, uint8_t bank)
+{
+    volatile struct usb_device_endpoint_register_t *endpoint = ENDPOINT(ep);
+    volatile struct usb_device_bank_t *b = &descriptors[ep].banks[bank];
+
+    endpoint->epintflag = (EPINTFLAG_TRCPT0 << bank);
+
+    void (*f)(const volatile uint8_t*, size_t) = context.receive_callbacks[ep - 1];
+    if(f)
+        f((const volatile uint8_t*) b->addr, b->pcksize & 0x3fff); // BYTE_COUNT
+
+    endpoint->epstatusclr = (EPSTATUS_BK0RDY << bank);
+}
+
+/* Calls callback from the USB interrupt whenever the bus gets suspended or
+ * resumed (including by a bus reset), along with the callbacks registered
+ * before. Returns false if there is no room left.
+ */
+bool udc_register_suspend_callback(void (*callback)(bool suspended))
+{
+    for(size_t i = 0; i < MAX_SUSPEND_CALLBACKS; ++i)
+    {
+        if(!context.suspend_callbacks[i])
+        {
+            context.suspend_callbacks[i] = callback;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Calls callback from the USB interrupt on each bus reset, once the endpoints
+ * are unconfigured (USB 2.0, 9.1.1.3: the device is back in Default state)
+ */
+void udc_register_reset_callback(void (*callback)(void))
+{
+    context.reset_callback = callback;
+}
+
+/* Signals an upstream resume to the host, which must have enabled remote
+ * wakeup beforehand. The bus must have been idle for at least 5 ms (USB 2.0,
+ * 7.1.7.7), which suspend detection (3 ms) and human reaction time cover.
+ */
+bool udc_remote_wakeup(void)
+{
+    if(!context.suspended)
+        return false;
+    // Cleared by the hardware once the resume has been sent
+    if(!(USB->ctrlb & CTRLB_UPRSM))
+        USB->ctrlb |= CTRLB_UPRSM;
+    return true;
+}
+
+/* Calls callback right after each start-of-frame (every 1 ms) with the frame
+ * number, NULL disables the SOF interrupt
+ */
+void udc_register_sof_callback(void (*callback)(uint16_t frame))
+{
+    context.sof_callback = callback;
+    if(callback)
+    {
+        USB->intflag = INTFLAG_SOF;
+        USB->intenset = INTFLAG_SOF;
+    }
+    else
+        USB->intenclr = INTFLAG_SOF;
+}
+
+// EP0 IN bank sent: runs the action that had to wait for the status stage
+static void control_status_complete(void)
+{
+    volatile struct usb_device_endpoint_register_t *endpoint0 = ENDPOINT(0);
+    if(context.pending_control.type != UDC_CONTROL_NONE)
+        context.pending_control.callback(&context.pending_control);
+    context.pending_control.type = UDC_CONTROL_NONE;
+    endpoint0->epstatusclr = EPSTATUS_BK1RDY;
+    endpoint0->epintflag = EPINTFLAG_TRCPT1;
+}
+
 void usb_handler(void)
 {
     uint16_t intflag = USB->intflag;
@@ -403,13 +745,13 @@ void usb_handler(void)
     
     if(intflag & INTFLAG_SUSPEND)
     {
-        context.suspended = true;
         USB->intflag = INTFLAG_SUSPEND;
+        set_suspended(true);
     }
     if(intflag & (INTFLAG_WAKEUP | INTFLAG_EORSM))
     {
-        context.suspended = false;
         USB->intflag = INTFLAG_WAKEUP | INTFLAG_EORSM;
+        set_suspended(false);
     }
     if(intflag & INTFLAG_EORST)
     {
@@ -432,33 +774,59 @@ void usb_handler(void)
         {
             if(epintflag & EPINTFLAG_RXSTP)
             {
+                /* A TRCPT1 seen along with the setup packet belongs to the
+                 * previous transfer: its status stage is over, but it must
+                 * not advance the data stage the setup packet may start
+                 */
+                if(epintflag & EPINTFLAG_TRCPT1)
+                {
+                    control_status_complete();
+                    epintflag &= ~EPINTFLAG_TRCPT1;
+                }
+
+                // A new setup packet aborts any unfinished data stage
+                context.control_in.active = false;
                 usb_setup_packet(buf0);
                 endpoint->epstatusclr = EPSTATUS_BK0RDY;
                 endpoint->epintflag = EPINTFLAG_RXSTP;
             }
             if(epintflag & EPINTFLAG_TRCPT1)
             {
-                if(context.pending_control.type != UDC_CONTROL_NONE)
-                    context.pending_control.callback(&context.pending_control);
-                context.pending_control.type = UDC_CONTROL_NONE;
-                endpoint->epstatusclr = EPSTATUS_BK1RDY;
-                endpoint->epintflag = EPINTFLAG_TRCPT1;
+                control_status_complete();
+                if(context.control_in.active)
+                    control_in_next();
             }
         }
         else
         {
-            if(epintflag & EPINTFLAG_TRCPT0)
+            if(context.dual_out & (1 << i))
             {
-                void (*f)(void) = context.receive_callbacks[i-1];
+                // Banks are read in the order the hardware filled them
+                for(size_t n = 0; n < 2; ++n)
+                {
+                    uint8_t b = context.next_bank[i];
+                    if(!(endpoint->epintflag & (EPINTFLAG_TRCPT0 << b)))
+                        break;
+                    receive_bank(i, b);
+                    context.next_bank[i] = b ^ 1;
+                }
+            }
+            else if((epintflag & EPINTFLAG_TRCPT0) && (context.dual_in & (1 << i)))
+            {
+                // Bank 0 of a dual bank IN endpoint
+                endpoint->epintflag = EPINTFLAG_TRCPT0;
+                context.send_requests[i - 1] = false;
+
+                void (*f)(void) = context.send_callbacks[i - 1];
                 if(f)
                     f();
-            
-                endpoint->epstatusclr = EPSTATUS_BK0RDY;
-                endpoint->epintflag = EPINTFLAG_TRCPT0;
             }
-            if(epintflag & EPINTFLAG_TRCPT1)
+            else if(epintflag & EPINTFLAG_TRCPT0)
+                receive_bank(i, 0);
+            if((epintflag & EPINTFLAG_TRCPT1) && !(context.dual_out & (1 << i)))
             {
                 endpoint->epintflag = EPINTFLAG_TRCPT1;
+                context.send_requests[i - 1] = false;
                 
                 void (*f)(void) = context.send_callbacks[i - 1];
                 if(f)
@@ -474,7 +842,7 @@ void usb_handler(void)
                 endpoint->epstatusset = EPSTATUS_STALLRQ1;
                 endpoint->epintflag = EPINTFLAG_STALL1;
             }
-            if(epintflag & EPINTFLAG_TRFAIL1)
+            if((epintflag & EPINTFLAG_TRFAIL1) && !(context.dual_out & (1 << i)))
             {
                 endpoint->epstatusclr = EPSTATUS_BK1RDY;
                 endpoint->epintflag = EPINTFLAG_TRFAIL1;
@@ -486,5 +854,29 @@ void usb_handler(void)
             }
         }
     }
+
+    // After the completions, so that the callback finds every free bank
+    if(intflag & INTFLAG_SOF)
+    {
+        uint16_t fnum = USB->fnum;
+        USB->intflag = INTFLAG_SOF;
+
+        // A corrupted frame number is not reported
+        void (*f)(uint16_t) = context.sof_callback;
+        if(f && !(fnum & FNUM_FNCERR))
+            f(FNUM_FNUM(fnum));
+    }
+
+    // Send requests posted from lower priority contexts
+    for(size_t i = 1; i < NENDPOINTS; ++i)
+    {
+        if(!context.send_requests[i - 1] || udc_tx_pending(i) >= udc_tx_banks(i))
+            continue;
+        context.send_requests[i - 1] = false;
+
+        void (*f)(void) = context.send_callbacks[i - 1];
+        if(f)
+            f();
+    }
 }
 
@@ -28,16 +28,26 @@ struct udc_control_callback
 void udc_init(void);
 void udc_attach(void);
 bool udc_is_attached(void);
-void udc_endpoint_configure(const struct usb_endpoint_descriptor_t *descriptor);
+bool udc_endpoint_configure(const struct usb_endpoint_descriptor_t *descriptor);
 void udc_endpoint_unconfigure(void);
-void udc_endpoint_set_buffer(uint8_t ep, enum endpoint_direction_e direction, volatile void *buffer);
-void udc_tx(uint8_t ep, const void *data, size_t size);
+void udc_endpoint_set_dual_bank(uint8_t ep, bool enable);
+bool udc_tx_acquire(uint8_t ep);
+bool udc_tx_submit(uint8_t ep, const void *data, size_t size);
+void udc_tx_release(uint8_t ep);
+uint8_t udc_tx_pending(uint8_t ep);
+uint8_t udc_tx_banks(uint8_t ep);
+void udc_request_send(uint8_t ep);
 void usb_rx(uint8_t ep, size_t size);
+void udc_control_tx(const void *data, size_t size, size_t length);
 void udc_control_send(const struct udc_control_callback *cb);
 void udc_set_address(uint8_t address);
 void udc_stall(uint8_t ep);
-void udc_register_receive_callback(uint8_t ep, void (*callback)(void));
+void udc_register_receive_callback(uint8_t ep, void (*callback)(const volatile uint8_t *data, size_t size));
 void udc_register_send_callback(uint8_t ep, void (*callback)(void));
+void udc_register_sof_callback(void (*callback)(uint16_t frame));
+bool udc_register_suspend_callback(void (*callback)(bool suspended));
+void udc_register_reset_callback(void (*callback)(void));
+bool udc_remote_wakeup(void);
 bool udc_is_suspended(void);
 
 void udc_dump_endpoint(uint8_t ep);
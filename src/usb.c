@@ -28,15 +28,19 @@ struct __attribute__((packed)) usb_setup_packet_t
 static struct
 {
     const struct usb_device_descriptor_t *device_descriptor;
-    const struct usb_configuration_descriptor_t *configuration_descriptors[USB_MAX_CONFIGURATION_AMOUNT];
+    const struct usb_configuration_t *configurations[USB_MAX_CONFIGURATION_AMOUNT];
     const void *string_descriptors[USB_MAX_STRING_AMOUNT];
     const struct usb_qualifier_descriptor_t *qualifier_descriptors[USB_MAX_QUALIFIER_AMOUNT];
     
     usb_configuration_cb configuration_cb;
     uint16_t selected_configuration;
+
+    bool remote_wakeup; // Enabled by the host
+    uint16_t status; // GET_STATUS answer, must outlive the data stage
 } context = {
     .configuration_cb = NULL,
-    .selected_configuration = 0
+    .selected_configuration = 0,
+    .remote_wakeup = false
 };
 
 static void usb_set_address_callback(const struct udc_control_callback *cb)
@@ -47,27 +51,47 @@ static void usb_set_address_callback(const struct udc_control_callback *cb)
 static void usb_set_config_callback(const struct udc_control_callback *cb)
 {
     uint16_t config = cb->wValue;
-    if(!config || config >= USB_MAX_CONFIGURATION_AMOUNT + 1)
-        udc_endpoint_unconfigure();
-    else
+
+    // Endpoint buffers of the former configuration are given back
+    udc_endpoint_unconfigure();
+
+    const struct usb_configuration_t *configuration = NULL;
+    if(config && config < USB_MAX_CONFIGURATION_AMOUNT + 1)
+        configuration = context.configurations[config - 1];
+    for(size_t i = 0; configuration && i < configuration->n_endpoints; ++i)
     {
-        const struct usb_configuration_descriptor_t *descriptor = context.configuration_descriptors[config - 1];
-        if(!descriptor)
-            udc_endpoint_unconfigure();
-        else
+        // Endpoint buffers do not fit: the device stays in Address state
+        if(!udc_endpoint_configure(configuration->endpoints[i]))
         {
-            const uint8_t *ptr = (const uint8_t*) descriptor;
-            const uint8_t *end = ptr + descriptor->wTotalLength;
-            for(ptr += ptr[0]; ptr < end; ptr += ptr[0])
-                if(ptr[1] == 0x05) // Endpoint descriptor
-                    udc_endpoint_configure((void*)ptr);
-
-            // Notify higher level
-            if(context.configuration_cb != NULL)
-                context.configuration_cb(config);
+            udc_endpoint_unconfigure();
+            configuration = NULL;
         }
     }
+    if(!configuration)
+        config = 0;
     context.selected_configuration = config;
+
+    // Notify higher level, 0 when the endpoints are gone
+    if(context.configuration_cb != NULL)
+        context.configuration_cb(config);
+}
+
+/* USB 2.0, 9.1.1.3: a bus reset brings the device back to Default state,
+ * remote wakeup is disabled (9.4.5) until the host enables it again
+ */
+static void usb_reset_callback(void)
+{
+    context.selected_configuration = 0;
+    context.remote_wakeup = false;
+
+    // The endpoints are gone, as after SET_CONFIGURATION 0
+    if(context.configuration_cb != NULL)
+        context.configuration_cb(0);
+}
+
+void usb_init(void)
+{
+    udc_register_reset_callback(usb_reset_callback);
 }
 
 void usb_setup_packet(const volatile void *_buf)
@@ -86,21 +110,28 @@ void usb_setup_packet(const volatile void *_buf)
         uint16_t id   = (wValue & 0xff);
         switch(bRequest)
         {
+            case 0x00: // GET_STATUS
+                // 9.4.5: D0 Self Powered, D1 Remote Wakeup
+                context.status = (context.remote_wakeup ? (1 << 1) : 0);
+                udc_control_tx(&context.status, sizeof(context.status), length);
+                break;
+
             case 0x06: //GET_DESCRIPTOR
                 switch(type)
                 {
                     case 0x01: // DEVICE
                         if(id == 0)
-                            udc_tx(0, context.device_descriptor, sizeof(*context.device_descriptor));
+                            udc_control_tx(context.device_descriptor, sizeof(*context.device_descriptor), length);
                         else
                             udc_stall(0);
                         break;
                     case 0x02: // CONFIGURATION
                         if(id < USB_MAX_CONFIGURATION_AMOUNT)
                         {
-                            const struct usb_configuration_descriptor_t *descriptor = context.configuration_descriptors[id];
-                            if(descriptor)
+                            const struct usb_configuration_t *configuration = context.configurations[id];
+                            if(configuration)
                             {
+                                const struct usb_configuration_descriptor_t *descriptor = configuration->descriptor;
                                 /* /!\ Here, we must not send the entire
                                  * configuration descriptor. First, the host asks
                                  * for the configuration itself (9 bytes). Then,
@@ -111,9 +142,9 @@ void usb_setup_packet(const volatile void *_buf)
                                  */
                                 /* Also, we might want to reduce buffer overflow
                                  * risks, why should we trust the host after all?
+                                 * udc_control_tx truncates to wLength.
                                  */
-                                size_t size = (length <= descriptor->wTotalLength ? length : descriptor->wTotalLength);
-                                udc_tx(0, descriptor, size);
+                                udc_control_tx(descriptor, descriptor->wTotalLength, length);
                                 break;
                             }
                         }
@@ -126,7 +157,7 @@ void usb_setup_packet(const volatile void *_buf)
                             if(descriptor)
                             {
                                 uint8_t size = *(const uint8_t*) descriptor;
-                                udc_tx(0, descriptor, size);
+                                udc_control_tx(descriptor, size, length);
                                 break;
                             }
                         }
@@ -138,7 +169,7 @@ void usb_setup_packet(const volatile void *_buf)
                             const struct usb_qualifier_descriptor_t *descriptor = context.qualifier_descriptors[id];
                             if(descriptor)
                             {
-                                udc_tx(0, descriptor, sizeof(*descriptor));
+                                udc_control_tx(descriptor, sizeof(*descriptor), length);
                                 break;
                             }
                         }
@@ -172,6 +203,26 @@ void usb_setup_packet(const volatile void *_buf)
                 break;
             }
 
+            case 0x01: // CLEAR_FEATURE
+            case 0x03: // SET_FEATURE
+            {
+                // 9.4.1, 9.4.9: DEVICE_REMOTE_WAKEUP is the only device feature of a full-speed device
+                if(wValue != 1)
+                {
+                    udc_stall(0);
+                    break;
+                }
+                context.remote_wakeup = (bRequest == 0x03);
+
+                struct udc_control_callback cb = {
+                    .type = UDC_CONTROL_NONE,
+                    .wValue = wValue,
+                    .callback = NULL
+                };
+                udc_control_send(&cb);
+                break;
+            }
+
             case 0x09: // SET_CONFIGURATION
             {
                 struct udc_control_callback cb = {
@@ -194,6 +245,11 @@ void usb_setup_packet(const volatile void *_buf)
     }
 }
 
+bool usb_remote_wakeup_enabled(void)
+{
+    return context.remote_wakeup;
+}
+
 bool usb_is_configured(uint16_t config)
 {
     return context.selected_configuration == config;
@@ -209,11 +265,11 @@ void usb_set_device_descriptor(const struct usb_device_descriptor_t *descriptor)
     context.device_descriptor = descriptor;
 }
 
-bool usb_set_configuration_descriptor(uint16_t config, const void *descriptor)
+bool usb_set_configuration(uint16_t config, const struct usb_configuration_t *configuration)
 {
     if(config == 0 || config >= USB_MAX_CONFIGURATION_AMOUNT + 1)
         return false;
-    context.configuration_descriptors[config - 1] = descriptor;
+    context.configurations[config - 1] = configuration;
     return true;
 }
 
@@ -2,10 +2,24 @@
 #define USB_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 
+#include "usb_common.h"
+
 #define USB_STRLEN(x) (sizeof(x) / sizeof((x)[0]))
 
+/* Configuration descriptors are declared as a packed struct with one member
+ * per descriptor, so that lengths are computed at build time:
+ *  - from member first (included) to member last (excluded)
+ *  - from member first (included) to the end of the configuration
+ */
+#define USB_DESCRIPTORS_LENGTH(type, first, last) (offsetof(type, last) - offsetof(type, first))
+#define USB_DESCRIPTORS_LENGTH_FROM(type, first) (sizeof(type) - offsetof(type, first))
+
+// Any endpoint descriptor starts with the standard fields
+#define USB_ENDPOINT_DESCRIPTOR(x) ((const struct usb_endpoint_descriptor_t*) &(x))
+
 #define USB_LANGID_DESCRIPTOR_T(x) \
 struct __attribute__((packed)) \
 { \
@@ -42,6 +56,7 @@ struct __attribute__((packed)) usb_device_descriptor_t
     uint8_t iSerialNumber;
     uint8_t bNumConfigurations;
 };
+_Static_assert(sizeof(struct usb_device_descriptor_t) == 18, "Device descriptor must be packed");
 
 struct __attribute__((packed)) usb_configuration_descriptor_t
 {
@@ -54,6 +69,7 @@ struct __attribute__((packed)) usb_configuration_descriptor_t
     uint8_t bmAttributes;
     uint8_t bMaxPower;
 };
+_Static_assert(sizeof(struct usb_configuration_descriptor_t) == 9, "Configuration descriptor must be packed");
 
 struct __attribute__((packed)) usb_interface_descriptor_t
 {
@@ -67,6 +83,7 @@ struct __attribute__((packed)) usb_interface_descriptor_t
     uint8_t bInterfaceProtocol;
     uint8_t iInterface;
 };
+_Static_assert(sizeof(struct usb_interface_descriptor_t) == 9, "Interface descriptor must be packed");
 
 struct __attribute__((packed)) usb_qualifier_descriptor_t
 {
@@ -81,13 +98,23 @@ struct __attribute__((packed)) usb_qualifier_descriptor_t
     uint8_t bReserved;
 };
 
+// Configuration descriptor, followed by every other descriptor of the configuration
+struct usb_configuration_t
+{
+    const struct usb_configuration_descriptor_t *descriptor;
+    const struct usb_endpoint_descriptor_t *const *endpoints; // Configured on SET_CONFIGURATION
+    size_t n_endpoints;
+};
+
 typedef void (*usb_configuration_cb)(uint16_t);
 
+void usb_init(void);
 void usb_setup_packet(const volatile void *_buf);
 bool usb_is_configured(uint16_t config);
+bool usb_remote_wakeup_enabled(void);
 void usb_set_configuration_callback(usb_configuration_cb callback);
 void usb_set_device_descriptor(const struct usb_device_descriptor_t *descriptor);
-bool usb_set_configuration_descriptor(uint16_t config, const void *descriptor);
+bool usb_set_configuration(uint16_t config, const struct usb_configuration_t *configuration);
 bool usb_set_string_descriptor(uint16_t id, const void *descriptor);
 bool usb_set_qualifier_descriptor(uint16_t id, const struct usb_qualifier_descriptor_t *descriptor);
 
@@ -12,6 +12,7 @@ struct __attribute__((packed)) usb_endpoint_descriptor_t
     uint16_t wMaxPacketSize;
     uint8_t bInterval;
 };
+_Static_assert(sizeof(struct usb_endpoint_descriptor_t) == 7, "Endpoint descriptor must be packed");
 
 #endif
 
@@ -1,82 +1,502 @@
-#include <string.h>
-
 #include "usb_midi.h"
 #include "udc.h"
 #include "usb.h"
 #include "interrupt.h"
+#include "systick.h"
 #include "config.h"
 
-#define MIDI1_IN_ENDPOINT 1
+// Cable number of the embedded MIDI OUT jack
+#define MIDI1_CABLE 0
+
+// USB MIDI 1.0, 4: Cable Number (high nibble) and Code Index Number (low nibble)
+#define USB_MIDI_HEADER(cable, cin) ((uint8_t)(((cable) << 4) | (cin)))
 
-#define MAX_PACKET_SIZE 4
-#define N_PACKETS 64
+#define EVENT_SIZE 4
+#define N_EVENTS 64 // Must be a power of two, at most 128
 
-struct usb_midi_packet_t
+// Up to 16 events are sent per bulk transfer (wMaxPacketSize = 64)
+#define MAX_EVENTS_PER_TRANSFER 16
+
+struct __attribute__((aligned(4))) usb_midi_event_t
 {
-    uint8_t data[MAX_PACKET_SIZE];
-    uint8_t size;
+    uint8_t data[EVENT_SIZE];
 };
 
+// The IN endpoint is dual bank: up to two transfers are handed to the UDC
+#define MAX_TRANSFERS 2
+
+// Events received from the host, waiting for the application
+#define N_RX_EVENTS 32 // Must be a power of two, at most 128
+
+// Controllers whose last values are tracked, see usb_midi_control_change_14bit
+#define N_CONTROLLERS 8
+#define CONTROLLER_UNKNOWN 0xff
+
+/* Single-producer/single-consumer ring:
+ *  - head is only written by the producer (note path, which runs at a single
+ *    interrupt priority lower than USB's)
+ *  - tail is only written by the consumer (USB interrupt)
+ * Events between tail and head are owned by the consumer, including the ones
+ * currently handed to the UDC, which sends contiguous slices of the ring
+ * without any copy.
+ */
 static struct
 {
-    struct usb_midi_packet_t packets[N_PACKETS];
-    struct usb_midi_packet_t * volatile current;
-    struct usb_midi_packet_t * volatile stack;
+    struct usb_midi_event_t events[N_EVENTS];
+    uint32_t stamps[N_EVENTS]; // Creation time of each event, see systick_now
+    volatile uint8_t head;
+    volatile uint8_t tail;
+
+    // Events of each transfer handed to the UDC, oldest first
+    uint8_t in_flight[MAX_TRANSFERS];
+    uint8_t n_transfers;
+    uint8_t n_in_flight; // Sum of in_flight
+
+    // Events are only sent right after each start-of-frame
+    volatile bool sof_sync;
+    uint16_t last_frame;
+    bool last_frame_valid;
+
+    /* Receive queue, single-producer/single-consumer:
+     *  - rx_head is only written by the USB interrupt
+     *  - rx_tail is only written by the application
+     */
+    struct usb_midi_event_t rx_events[N_RX_EVENTS];
+    volatile uint8_t rx_head;
+    volatile uint8_t rx_tail;
+
+    struct usb_midi_stats_t stats;
+
+    // Last values sent (producer side only), MSB controllers 0 to 31
+    struct
+    {
+        uint8_t channel;
+        uint8_t controller;
+        uint8_t msb;
+        uint8_t lsb;
+    } controllers[N_CONTROLLERS];
+    uint8_t n_controllers;
+    volatile bool controllers_stale; // Set by the USB interrupt, see forget_controllers
 } context;
 
-static bool tx(const void *data, size_t size)
+// USB MIDI 1.0, Table 4-1
+static uint8_t code_index_number(uint8_t status)
 {
-    if(!udc_is_attached() || udc_is_suspended() || !usb_is_configured(MIDI1_IN_ENDPOINT))
-        return false;
+    // Channel messages: the CIN is the message type
+    if(status < 0xf0)
+        return (status >> 4);
 
-    interrupt_disable();
-    
-    if(context.current == context.stack)
-         udc_tx(MIDI1_IN_ENDPOINT, data, size);
-    else
+    switch(status)
     {
-        memcpy(context.stack, data, size);
-        context.stack->size = size;
-        if(++context.stack >= context.packets + N_PACKETS)
-            context.stack = context.packets;
+        case 0xf0 | MIDI_SYS_SONG_SELECT:
+            return 0x2; // Two-byte System Common message
+        case 0xf0 | MIDI_SYS_SONG_POINTER:
+            return 0x3; // Three-byte System Common message
+        case 0xf0 | MIDI_SYS_TUNE_REQUEST:
+            return 0x5; // Single-byte System Common message
+        default:
+            return 0xf; // Single byte (real-time messages)
     }
-    
-    interrupt_enable();
+}
+
+/* Returns the next free slot of the ring, where the caller encodes the MIDI
+ * message from the second byte on, or NULL if the event cannot be queued.
+ */
+static uint8_t *reserve(void)
+{
+    if(!udc_is_attached() || udc_is_suspended() || !usb_is_configured(USB_MIDI_IN_ENDPOINT))
+        return NULL;
+
+    uint8_t head = context.head;
+    if((uint8_t)(head - context.tail) >= N_EVENTS)
+    {
+        ++context.stats.dropped;
+        return NULL;
+    }
+    return context.events[head & (N_EVENTS - 1)].data;
+}
+
+/* Publishes the slot returned by reserve()
+ * end: pointer returned by the midi_* encoder
+ */
+static bool commit(uint8_t *end)
+{
+    uint8_t head = context.head;
+    uint8_t *event = context.events[head & (N_EVENTS - 1)].data;
+
+    // Unused bytes of the event must be zero
+    while(end < event + EVENT_SIZE)
+        *end++ = 0;
+    event[0] = USB_MIDI_HEADER(MIDI1_CABLE, code_index_number(event[1]));
+    context.stamps[head & (N_EVENTS - 1)] = systick_now();
+
+    compiler_barrier(); // The event must be complete before being published
+    context.head = head + 1;
+
+    uint8_t used = head + 1 - context.tail;
+    if(used > context.stats.high_water)
+        context.stats.high_water = used;
+
+    // Otherwise the next SOF sends it
+    if(!context.sof_sync)
+        udc_request_send(USB_MIDI_IN_ENDPOINT);
     return true;
 }
 
+// Gives the slots of the completed transfers back to the producer
+static void release_transfers(void)
+{
+    uint8_t pending = udc_tx_pending(USB_MIDI_IN_ENDPOINT);
+    for(; context.n_transfers > pending; --context.n_transfers)
+    {
+        context.tail += context.in_flight[0];
+        context.n_in_flight -= context.in_flight[0];
+        for(size_t i = 1; i < MAX_TRANSFERS; ++i)
+            context.in_flight[i - 1] = context.in_flight[i];
+    }
+}
+
+// Fills every free bank of the endpoint, returns the number of events sent
+static uint8_t fill_transfers(void)
+{
+    uint8_t sent = 0;
+    uint8_t banks = udc_tx_banks(USB_MIDI_IN_ENDPOINT);
+    while(context.n_transfers < banks)
+    {
+        uint8_t next = context.tail + context.n_in_flight;
+        uint8_t count = context.head - next;
+        if(!count || !udc_tx_acquire(USB_MIDI_IN_ENDPOINT))
+            break;
+
+        /* Send every queued event at once, as long as they are contiguous in
+         * the ring: events past the end of the ring go with the next transfer.
+         */
+        uint8_t first = (next & (N_EVENTS - 1));
+        if(count > N_EVENTS - first)
+            count = N_EVENTS - first;
+        if(count > MAX_EVENTS_PER_TRANSFER)
+            count = MAX_EVENTS_PER_TRANSFER;
+
+        udc_tx_submit(USB_MIDI_IN_ENDPOINT, &context.events[first], count * EVENT_SIZE);
+        context.in_flight[context.n_transfers++] = count;
+        context.n_in_flight += count;
+        sent += count;
+
+        ++context.stats.transfers;
+        context.stats.events_sent += count;
+        if(count > context.stats.max_batch)
+            context.stats.max_batch = count;
+
+        uint32_t now = systick_now();
+        for(uint8_t i = first; i < first + count; ++i)
+        {
+            uint32_t delay = systick_elapsed(context.stamps[i], now);
+            context.stats.total_delay += delay;
+            if(delay > context.stats.max_delay)
+                context.stats.max_delay = delay;
+        }
+    }
+    return sent;
+}
+
 static void usb_midi_send_callback(void)
 {
-    interrupt_disable();
-    
-    if(context.current != context.stack)
+    release_transfers();
+    if(!context.sof_sync)
+        fill_transfers();
+}
+
+static void usb_midi_sof_callback(uint16_t frame)
+{
+    // Frame numbers are 11-bit
+    if(context.last_frame_valid)
+        context.stats.missed_frames += ((frame - context.last_frame - 1) & 0x7ff);
+    context.last_frame = frame;
+    context.last_frame_valid = true;
+
+    release_transfers();
+    uint8_t sent = fill_transfers();
+    if(sent)
     {
-        udc_tx(MIDI1_IN_ENDPOINT, context.current->data, context.current->size);
-        if(++context.current >= context.packets + N_PACKETS)
-            context.current = context.packets;
+        ++context.stats.frames;
+        if(sent > context.stats.max_events_per_frame)
+            context.stats.max_events_per_frame = sent;
     }
-    
-    interrupt_enable();
+}
+
+/* SOFs stop while the bus is suspended or being reset: the frames skipped
+ * meanwhile are not missed
+ */
+static void usb_midi_suspend_callback(bool suspended)
+{
+    (void) suspended;
+    context.last_frame_valid = false;
+    context.controllers_stale = true;
+}
+
+// Called on SET_CONFIGURATION, and with 0 on bus reset
+static void usb_midi_configuration_callback(uint16_t config)
+{
+    (void) config;
+    context.last_frame_valid = false;
+    context.controllers_stale = true;
+
+    /* The transfers handed to the UDC are gone with the endpoints, and the
+     * events still queued were meant for the former configuration. Counted
+     * apart from dropped, which the producers update at a lower priority.
+     */
+    uint8_t head = context.head;
+    context.stats.reset_dropped += (uint8_t)(head - context.tail);
+    context.n_transfers = 0;
+    context.n_in_flight = 0;
+    context.tail = head;
+}
+
+// USB MIDI 1.0, Table 4-1: size of the MIDI message carried by each CIN
+static const uint8_t MESSAGE_SIZES[16] = {
+    0, 0, // Reserved
+    2, 3, // Two/three-byte System Common
+    3, 1, 2, 3, // SysEx starts/continues, SysEx ends with 1, 2, 3 bytes
+    3, 3, 3, 3, 2, 2, 3, // Note-off ... Pitch bend change
+    1 // Single byte
+};
+
+static void usb_midi_receive_callback(const volatile uint8_t *data, size_t size)
+{
+    const volatile struct usb_midi_event_t *events = (const volatile struct usb_midi_event_t*) data;
+    uint8_t head = context.rx_head;
+    for(size_t i = 0; i < size / EVENT_SIZE; ++i)
+    {
+        // Zero padding and reserved CINs carry no message
+        if(!MESSAGE_SIZES[events[i].data[0] & 0xf])
+            continue;
+
+        if((uint8_t)(head - context.rx_tail) >= N_RX_EVENTS)
+        {
+            ++context.stats.rx_dropped;
+            continue;
+        }
+        struct usb_midi_event_t *event = &context.rx_events[head & (N_RX_EVENTS - 1)];
+        for(size_t j = 0; j < EVENT_SIZE; ++j)
+            event->data[j] = events[i].data[j];
+        ++head;
+        ++context.stats.rx_events;
+    }
+
+    compiler_barrier(); // The events must be complete before being published
+    context.rx_head = head;
 }
 
 void usb_midi_init(void)
 {
-    context.current = context.packets;
-    context.stack = context.packets;
+    context.head = 0;
+    context.tail = 0;
+    context.n_transfers = 0;
+    context.n_in_flight = 0;
+    context.stats.dropped = 0;
+    context.stats.reset_dropped = 0;
+    context.stats.high_water = 0;
+    context.stats.transfers = 0;
+    context.stats.events_sent = 0;
+    context.stats.max_batch = 0;
+    context.stats.total_delay = 0;
+    context.stats.max_delay = 0;
+    context.stats.frames = 0;
+    context.stats.max_events_per_frame = 0;
+    context.stats.missed_frames = 0;
+    context.sof_sync = false;
+    context.rx_head = 0;
+    context.rx_tail = 0;
+    context.stats.rx_events = 0;
+    context.stats.rx_dropped = 0;
+    context.n_controllers = 0;
+    context.controllers_stale = false;
     
-    udc_register_send_callback(MIDI1_IN_ENDPOINT, usb_midi_send_callback);
+    udc_register_suspend_callback(usb_midi_suspend_callback);
+    usb_set_configuration_callback(usb_midi_configuration_callback);
+    udc_endpoint_set_dual_bank(USB_MIDI_IN_ENDPOINT, true);
+    udc_register_send_callback(USB_MIDI_IN_ENDPOINT, usb_midi_send_callback);
+    udc_endpoint_set_dual_bank(USB_MIDI_OUT_ENDPOINT, true);
+    udc_register_receive_callback(USB_MIDI_OUT_ENDPOINT, usb_midi_receive_callback);
+}
+
+/* In SOF synchronized mode, queued events are only sent right after each
+ * start-of-frame, which gives a deterministic 1 ms framing
+ */
+void usb_midi_set_sof_sync(bool enable)
+{
+    context.last_frame_valid = false;
+    context.sof_sync = enable;
+    udc_register_sof_callback(enable ? usb_midi_sof_callback : NULL);
+
+    // Events queued meanwhile must not wait for a SOF anymore
+    if(!enable)
+        udc_request_send(USB_MIDI_IN_ENDPOINT);
+}
+
+/* Pops the oldest MIDI message received from the host, must not be called
+ * from more than one context
+ * message: at least 3 bytes
+ * cable: if not NULL, receives the cable number of the message
+ * Returns the size of the message, 0 if there is none
+ */
+size_t usb_midi_receive(uint8_t *message, uint8_t *cable)
+{
+    uint8_t tail = context.rx_tail;
+    if(tail == context.rx_head)
+        return 0;
+
+    const struct usb_midi_event_t *event = &context.rx_events[tail & (N_RX_EVENTS - 1)];
+    size_t size = MESSAGE_SIZES[event->data[0] & 0xf];
+    for(size_t i = 0; i < size; ++i)
+        message[i] = event->data[i + 1];
+    if(cable)
+        *cable = (event->data[0] >> 4);
+
+    compiler_barrier(); // The slot must be read before being given back
+    context.rx_tail = tail + 1;
+    return size;
+}
+
+void usb_midi_get_stats(struct usb_midi_stats_t *stats)
+{
+    *stats = context.stats;
 }
 
 bool usb_midi_note_off(uint8_t channel, uint8_t key, uint8_t velocity)
 {
-    uint8_t __attribute__((aligned(4))) tmp[4] = {0x09};
-    midi_note_off(tmp + 1, channel, key, velocity);
-    return tx(tmp, sizeof(tmp));
+    uint8_t *event = reserve();
+    return event && commit(midi_note_off(event + 1, channel, key, velocity));
 }
 
 bool usb_midi_note_on(uint8_t channel, uint8_t key, uint8_t velocity)
 {
-    uint8_t __attribute__((aligned(4))) tmp[4] = {0x09};
-    midi_note_on(tmp + 1, channel, key, velocity);
-    return tx(tmp, sizeof(tmp));
+    uint8_t *event = reserve();
+    return event && commit(midi_note_on(event + 1, channel, key, velocity));
+}
+
+bool usb_midi_polyphonic_pressure(uint8_t channel, uint8_t key, uint8_t velocity)
+{
+    uint8_t *event = reserve();
+    return event && commit(midi_polyphonic_pressure(event + 1, channel, key, velocity));
+}
+
+/* The host might have lost the values sent before a bus reset, a new
+ * configuration or a suspend: every byte is sent again. Called by the
+ * producer, so that the tracked values are only ever written from one side.
+ */
+static void forget_controllers(void)
+{
+    if(!context.controllers_stale)
+        return;
+    context.controllers_stale = false;
+    for(int i = 0; i < context.n_controllers; ++i)
+    {
+        context.controllers[i].msb = CONTROLLER_UNKNOWN;
+        context.controllers[i].lsb = CONTROLLER_UNKNOWN;
+    }
+}
+
+/* Slot of the 14-bit controller that controller (MSB or LSB) belongs to,
+ * -1 if it is not tracked (and there is no room left when add is set)
+ */
+static int find_controller(uint8_t channel, uint8_t controller, bool add)
+{
+    if(controller >= 64)
+        return -1;
+    controller &= 0x1f;
+    for(int i = 0; i < context.n_controllers; ++i)
+        if(context.controllers[i].channel == channel && context.controllers[i].controller == controller)
+            return i;
+    if(!add || context.n_controllers == N_CONTROLLERS)
+        return -1;
+
+    int i = context.n_controllers++;
+    context.controllers[i].channel = channel;
+    context.controllers[i].controller = controller;
+    context.controllers[i].msb = CONTROLLER_UNKNOWN;
+    context.controllers[i].lsb = CONTROLLER_UNKNOWN;
+    return i;
+}
+
+bool usb_midi_control_change(uint8_t channel, uint8_t controller, uint8_t value)
+{
+    uint8_t *event = reserve();
+    if(!event || !commit(midi_control_change(event + 1, channel, controller, value)))
+        return false;
+
+    // Every controller sent goes through here, so the tracked values stay right
+    int i = find_controller(channel, controller, false);
+    if(i >= 0)
+    {
+        if(controller < 32)
+        {
+            context.controllers[i].msb = value;
+            context.controllers[i].lsb = 0; // Reset by the receiver
+        }
+        else
+            context.controllers[i].lsb = value;
+    }
+    return true;
+}
+
+/* 14-bit controller (controller: MSB, 0 to 31, its LSB being controller + 32)
+ * where only the bytes that changed are sent. A new MSB resets the LSB on the
+ * receiver side (MIDI 1.0, Control Change), so the LSB then follows it,
+ * unless it is 0. Returns false if an event was not queued: the next call
+ * sends it again.
+ */
+bool usb_midi_control_change_14bit(uint8_t channel, uint8_t controller, uint16_t value)
+{
+    uint8_t msb = (value >> 7) & 0x7f;
+    uint8_t lsb = value & 0x7f;
+    if(controller >= 32)
+        return false;
+    forget_controllers();
+    int i = find_controller(channel, controller, true);
+    if(i < 0) // Not tracked
+        return usb_midi_control_change(channel, controller, msb)
+            && usb_midi_control_change(channel, controller + 32, lsb);
+
+    if(context.controllers[i].msb != msb && !usb_midi_control_change(channel, controller, msb))
+        return false;
+    if(context.controllers[i].lsb != lsb && !usb_midi_control_change(channel, controller + 32, lsb))
+        return false;
+    return true;
+}
+
+bool usb_midi_program_change(uint8_t channel, uint8_t program)
+{
+    uint8_t *event = reserve();
+    return event && commit(midi_program_change(event + 1, channel, program));
+}
+
+bool usb_midi_channel_pressure(uint8_t channel, uint8_t value)
+{
+    uint8_t *event = reserve();
+    return event && commit(midi_channel_pressure(event + 1, channel, value));
+}
+
+bool usb_midi_pitch_wheel_change(uint8_t channel, uint16_t value)
+{
+    uint8_t *event = reserve();
+    return event && commit(midi_pitch_wheel_change(event + 1, channel, value));
+}
+
+bool usb_midi_system(enum midi_system_e command)
+{
+    uint8_t *event = reserve();
+    return event && commit(midi_system(event + 1, command));
+}
+
+bool usb_midi_song_pointer(uint16_t pointer)
+{
+    uint8_t *event = reserve();
+    return event && commit(midi_song_pointer(event + 1, pointer));
+}
+
+bool usb_midi_song_select(uint8_t song)
+{
+    uint8_t *event = reserve();
+    return event && commit(midi_song_select(event + 1, song));
 }
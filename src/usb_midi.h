@@ -6,6 +6,14 @@
 #include <stdbool.h>
 
 #include "midi.h"
+#include "usb.h"
+
+#define USB_MIDI_IN_ENDPOINT 1
+#define USB_MIDI_OUT_ENDPOINT 2
+
+// USB MIDI 1.0, A.6
+#define USB_MIDI_JACK_EMBEDDED 0x01
+#define USB_MIDI_JACK_EXTERNAL 0x02
 
 struct __attribute__((packed)) cs_ac_interface_descriptor_t
 {
@@ -17,6 +25,7 @@ struct __attribute__((packed)) cs_ac_interface_descriptor_t
     uint8_t bInCollection;
     uint8_t baInterfaceNr;
 };
+_Static_assert(sizeof(struct cs_ac_interface_descriptor_t) == 9, "AC header descriptor must be packed");
 
 struct __attribute__((packed)) cs_ms_interface_descriptor_t
 {
@@ -26,6 +35,7 @@ struct __attribute__((packed)) cs_ms_interface_descriptor_t
     uint16_t bcdMSC;
     uint16_t wTotalLength;
 };
+_Static_assert(sizeof(struct cs_ms_interface_descriptor_t) == 7, "MS header descriptor must be packed");
 
 struct __attribute__((packed)) cs_ms_midi_in_descriptor_t
 {
@@ -36,6 +46,7 @@ struct __attribute__((packed)) cs_ms_midi_in_descriptor_t
     uint8_t bJackID;
     uint8_t iJack;
 };
+_Static_assert(sizeof(struct cs_ms_midi_in_descriptor_t) == 6, "MIDI IN jack descriptor must be packed");
 
 struct __attribute__((packed)) cs_ms_midi_out_endpoint_t
 {
@@ -49,6 +60,7 @@ struct __attribute__((packed)) cs_ms_midi_out_endpoint_t
     uint8_t baSourcePin;
     uint8_t iJack;
 };
+_Static_assert(sizeof(struct cs_ms_midi_out_endpoint_t) == 9, "MIDI OUT jack descriptor must be packed");
 
 struct __attribute__((packed)) bulk_endpoint_descriptor_t
 {
@@ -61,6 +73,7 @@ struct __attribute__((packed)) bulk_endpoint_descriptor_t
     uint8_t bRefresh;
     uint8_t bSynchAddress;
 };
+_Static_assert(sizeof(struct bulk_endpoint_descriptor_t) == 9, "Bulk endpoint descriptor must be packed");
 
 struct __attribute__((packed)) cs_ms_bulk_endpoint_descriptor_t
 {
@@ -70,10 +83,94 @@ struct __attribute__((packed)) cs_ms_bulk_endpoint_descriptor_t
     uint8_t bNumEmbMIDIJack;
     uint8_t baAssocJackID;
 };
+_Static_assert(sizeof(struct cs_ms_bulk_endpoint_descriptor_t) == 5, "MS bulk endpoint descriptor must be packed");
+
+// USB MIDI 1.0, 6.1.2.2: MIDI IN jack
+#define USB_MIDI_IN_JACK(type, id) { \
+    .bLength = sizeof(struct cs_ms_midi_in_descriptor_t), \
+    .bDescriptorType = 0x24, /* CS_INTERFACE */ \
+    .bDescriptorSubtype = 0x02, /* MIDI_IN_JACK */ \
+    .bJackType = (type), \
+    .bJackID = (id), \
+    .iJack = 0 \
+}
+
+// USB MIDI 1.0, 6.1.2.3: MIDI OUT jack, with a single input pin
+#define USB_MIDI_OUT_JACK(type, id, source) { \
+    .bLength = sizeof(struct cs_ms_midi_out_endpoint_t), \
+    .bDescriptorType = 0x24, /* CS_INTERFACE */ \
+    .bDescriptorSubtype = 0x03, /* MIDI_OUT_JACK */ \
+    .bJackType = (type), \
+    .bJackID = (id), \
+    .bNrInputPins = 1, \
+    .baSourceID = (source), \
+    .baSourcePin = 1, \
+    .iJack = 0 \
+}
+
+// USB MIDI 1.0, 6.2.1: standard bulk endpoint
+#define USB_MIDI_BULK_ENDPOINT(address, size) { \
+    .bLength = sizeof(struct bulk_endpoint_descriptor_t), \
+    .bDescriptorType = 0x05, /* ENDPOINT descriptor */ \
+    .bEndpointAddress = (address), \
+    .bmAttributes = 0x2, /* Bulk, not shared */ \
+    .wMaxPacketSize = (size), \
+    .bInterval = 0, \
+    .bRefresh = 0, \
+    .bSynchAddress = 0 \
+}
+
+// USB MIDI 1.0, 6.2.2: class-specific bulk endpoint, with a single embedded jack
+#define USB_MIDI_CS_BULK_ENDPOINT(jack) { \
+    .bLength = sizeof(struct cs_ms_bulk_endpoint_descriptor_t), \
+    .bDescriptorType = 0x25, /* CS_ENDPOINT */ \
+    .bDescriptorSubtype = 0x1, /* MS_GENERAL */ \
+    .bNumEmbMIDIJack = 1, \
+    .baAssocJackID = (jack) \
+}
+
+struct usb_midi_stats_t
+{
+    uint32_t dropped; // Events rejected because the transmit ring was full
+    uint32_t reset_dropped; // Events queued or in flight, not confirmed sent, when the configuration changed
+    uint8_t high_water; // Highest number of events ever queued at once
+
+    // Events per transfer = events_sent / transfers
+    uint32_t transfers;
+    uint32_t events_sent;
+    uint8_t max_batch; // Most events ever sent in a single transfer
+
+    /* Delay between the creation of an event and its handover to the UDC
+     * (right after the SOF in SOF synchronized mode), in CPU cycles
+     * Average delay = total_delay / events_sent
+     */
+    uint64_t total_delay;
+    uint32_t max_delay;
+
+    // SOF synchronized mode only
+    uint32_t frames; // Frames that sent at least one event, events per frame = events_sent / frames
+    uint8_t max_events_per_frame;
+    uint32_t missed_frames; // Start-of-frames never seen (gaps in frame numbers)
+
+    uint32_t rx_events; // Events received from the host
+    uint32_t rx_dropped; // Events lost because the receive queue was full
+};
 
 void usb_midi_init(void);
+void usb_midi_get_stats(struct usb_midi_stats_t *stats);
+void usb_midi_set_sof_sync(bool enable);
 bool usb_midi_note_off(uint8_t channel, uint8_t key, uint8_t velocity);
 bool usb_midi_note_on(uint8_t channel, uint8_t key, uint8_t velocity);
+bool usb_midi_polyphonic_pressure(uint8_t channel, uint8_t key, uint8_t velocity);
+bool usb_midi_control_change(uint8_t channel, uint8_t controller, uint8_t value);
+bool usb_midi_control_change_14bit(uint8_t channel, uint8_t controller, uint16_t value);
+bool usb_midi_program_change(uint8_t channel, uint8_t program);
+bool usb_midi_channel_pressure(uint8_t channel, uint8_t value);
+bool usb_midi_pitch_wheel_change(uint8_t channel, uint16_t value);
+bool usb_midi_system(enum midi_system_e command);
+bool usb_midi_song_pointer(uint16_t pointer);
+bool usb_midi_song_select(uint8_t song);
+size_t usb_midi_receive(uint8_t *message, uint8_t *cable);
 
 #endif
 
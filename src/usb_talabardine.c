@@ -20,7 +20,28 @@ const struct usb_device_descriptor_t __attribute__((aligned(4))) TALABARDINE_DEV
     .iSerialNumber = 3,
     .bNumConfigurations = 1 // 1 configuration
 };
-const struct __attribute__((packed, aligned(4)))
+enum talabardine_interface_e
+{
+    INTERFACE_AUDIO_CONTROL,
+    INTERFACE_MIDI_STREAMING,
+    N_INTERFACES
+};
+
+// USB MIDI 1.0, B.4.3: jack IDs, 0 is undefined
+enum talabardine_jack_e
+{
+    JACK_EMBEDDED_IN = 1, // From the host (bulk OUT)
+    JACK_EXTERNAL_IN,
+    JACK_EMBEDDED_OUT, // To the host (bulk IN)
+    JACK_EXTERNAL_OUT
+};
+
+#define MIDI_PACKET_SIZE 64
+
+/* Lengths and counts below are computed from this layout, which must not be
+ * padded: the blob itself is aligned where it is defined
+ */
+struct __attribute__((packed)) talabardine_config1_t
 {
     struct usb_configuration_descriptor_t configuration;
 
@@ -36,13 +57,16 @@ const struct __attribute__((packed, aligned(4)))
     struct cs_ms_bulk_endpoint_descriptor_t midi_cs_bulk_in;
     struct bulk_endpoint_descriptor_t midi_bulk_out;
     struct cs_ms_bulk_endpoint_descriptor_t midi_cs_bulk_out;
+};
 
-    } TALABARDINE_CONFIG1_DESCRIPTOR = {
+#define MIDI_STREAMING_ENDPOINTS 2
+
+const struct talabardine_config1_t __attribute__((aligned(4))) TALABARDINE_CONFIG1_DESCRIPTOR = {
     .configuration = {
-        .bLength = 9,
+        .bLength = sizeof(struct usb_configuration_descriptor_t),
         .bDescriptorType = 0x02, // Configuration Descriptor
-        .wTotalLength = 101,
-        .bNumInterfaces = 2,
+        .wTotalLength = sizeof(struct talabardine_config1_t),
+        .bNumInterfaces = N_INTERFACES,
         .bConfigurationValue = 1,
         .iConfiguration = 0,
         .bmAttributes = 0xa0, // D7 (reserved) | Remote wakeup
@@ -50,9 +74,9 @@ const struct __attribute__((packed, aligned(4)))
     },
 
     .midi1_interface = { // Standard AC interface descriptor
-        .bLength = 9,
+        .bLength = sizeof(struct usb_interface_descriptor_t),
         .bDescriptorType = 0x04, // Interface Descriptor
-        .bInterfaceNumber = 0,
+        .bInterfaceNumber = INTERFACE_AUDIO_CONTROL,
         .bAlternateSetting = 0,
         .bNumEndpoints = 0, // No endpoints
         .bInterfaceClass = 0x01, // Audio
@@ -61,106 +85,60 @@ const struct __attribute__((packed, aligned(4)))
         .iInterface = 0
     },
     .ac_interface = {
-        .bLength = 9,
+        .bLength = sizeof(struct cs_ac_interface_descriptor_t),
         .bDescriptorType = 0x24, // CS_INTERFACE
         .bDescriptorSubtype = 0x01, // HEADER
         .bcdADC = 0x0100, // Audio 1.0
-        .wTotalLength = 9,
+        .wTotalLength = USB_DESCRIPTORS_LENGTH(struct talabardine_config1_t, ac_interface, midi2_interface),
         .bInCollection = 1, // 1 streaming interface
-        .baInterfaceNr = 1
+        .baInterfaceNr = INTERFACE_MIDI_STREAMING
     },
 
     .midi2_interface = { // Standard MIDIStreaming descriptor
-        .bLength = 9,
+        .bLength = sizeof(struct usb_interface_descriptor_t),
         .bDescriptorType = 0x04, // Interface Descriptor
-        .bInterfaceNumber = 1,
+        .bInterfaceNumber = INTERFACE_MIDI_STREAMING,
         .bAlternateSetting = 0,
-        .bNumEndpoints = 2,
+        .bNumEndpoints = MIDI_STREAMING_ENDPOINTS,
         .bInterfaceClass = 0x01, // Audio
         .bInterfaceSubClass = 0x03, // MIDIStreaming
         .bInterfaceProtocol = 0,
         .iInterface = 0
     },
     .ms_interface = {
-        .bLength = 7,
+        .bLength = sizeof(struct cs_ms_interface_descriptor_t),
         .bDescriptorType = 0x24, // CS_INTERFACE
         .bDescriptorSubtype = 0x01, // MS_HEADER
         .bcdMSC = 0x0100,
-        .wTotalLength = 65
-    },
-    .midi_in_interfaces[0] = {
-        .bLength = 6,
-        .bDescriptorType = 0x24, // CS_INTERFACE
-        .bDescriptorSubtype = 0x02, // MIDI_IN_JACK
-        .bJackType = 0x1, // EMBEDDED
-        .bJackID = 0x1,
-        .iJack = 0x0
+        // Class-specific descriptors, jacks and endpoints included
+        .wTotalLength = USB_DESCRIPTORS_LENGTH_FROM(struct talabardine_config1_t, ms_interface)
     },
-    .midi_in_interfaces[1] = {
-        .bLength = 6,
-        .bDescriptorType = 0x24, // CS_INTERFACE
-        .bDescriptorSubtype = 0x02, // MIDI_IN_JACK
-        .bJackType = 0x2, // EXTERNAL
-        .bJackID = 0x2,
-        .iJack = 0x0
+    .midi_in_interfaces = {
+        USB_MIDI_IN_JACK(USB_MIDI_JACK_EMBEDDED, JACK_EMBEDDED_IN),
+        USB_MIDI_IN_JACK(USB_MIDI_JACK_EXTERNAL, JACK_EXTERNAL_IN)
     },
-    .midi_out_interface_0 = {
-        .bLength = 9,
-        .bDescriptorType = 0x24, // CS_INTERFACE
-        .bDescriptorSubtype = 0x03, // MIDI_OUT_JACK
-        .bJackType = 0x1, // EMBEDDED
-        .bJackID = 0x3,
-        .bNrInputPins = 1, // One input pin
-        .baSourceID = 0x2,
-        .baSourcePin = 0x1,
-        .iJack = 0
-    },
-    .midi_out_interface_1 = {
-        .bLength = 9,
-        .bDescriptorType = 0x24, // CS_INTERFACE
-        .bDescriptorSubtype = 0x03, // MIDI_OUT_JACK
-        .bJackType = 0x2, // EXTERNAL
-        .bJackID = 0x4,
-        .bNrInputPins = 1, // One input pin
-        .baSourceID = 0x1,
-        .baSourcePin = 0x1,
-        .iJack = 0
-    },
-    .midi_bulk_in = {
-        .bLength = 9,
-        .bDescriptorType = 0x5, // ENDPOINT descriptor
-        .bEndpointAddress = 0x81, // IN 1
-        .bmAttributes = 0x2, // Bulk, not shared
-        .wMaxPacketSize = 64,
-        .bInterval = 0,
-        .bRefresh = 0,
-        .bSynchAddress = 0
-    },
-    .midi_cs_bulk_in = {
-        .bLength = 5,
-        .bDescriptorType = 0x25, // CS_ENDPOINT
-        .bDescriptorSubtype = 0x1, // MS_GENERAL
-        .bNumEmbMIDIJack = 0x1,
-        .baAssocJackID = 0x3
-    },
-    .midi_bulk_out = {
-        .bLength = 9,
-        .bDescriptorType = 0x5, // ENDPOINT descriptor
-        .bEndpointAddress = 0x02, // OUT 2
-        .bmAttributes = 0x2, // Bulk, not shared
-        .wMaxPacketSize = 64,
-        .bInterval = 0,
-        .bRefresh = 0,
-        .bSynchAddress = 0
-    },
-    .midi_cs_bulk_out = {
-        .bLength = 5,
-        .bDescriptorType = 0x25, // CS_ENDPOINT
-        .bDescriptorSubtype = 0x1, // MS_GENERAL
-        .bNumEmbMIDIJack = 0x1,
-        .baAssocJackID = 0x1
-    }
+    .midi_out_interface_0 = USB_MIDI_OUT_JACK(USB_MIDI_JACK_EMBEDDED, JACK_EMBEDDED_OUT, JACK_EXTERNAL_IN),
+    .midi_out_interface_1 = USB_MIDI_OUT_JACK(USB_MIDI_JACK_EXTERNAL, JACK_EXTERNAL_OUT, JACK_EMBEDDED_IN),
+    .midi_bulk_in = USB_MIDI_BULK_ENDPOINT(0x80 | USB_MIDI_IN_ENDPOINT, MIDI_PACKET_SIZE),
+    .midi_cs_bulk_in = USB_MIDI_CS_BULK_ENDPOINT(JACK_EMBEDDED_OUT),
+    .midi_bulk_out = USB_MIDI_BULK_ENDPOINT(USB_MIDI_OUT_ENDPOINT, MIDI_PACKET_SIZE),
+    .midi_cs_bulk_out = USB_MIDI_CS_BULK_ENDPOINT(JACK_EMBEDDED_IN)
+};
+
+_Static_assert(sizeof(struct talabardine_config1_t) <= 0xffff, "wTotalLength overflow");
+
+static const struct usb_endpoint_descriptor_t *const TALABARDINE_CONFIG1_ENDPOINTS[] = {
+    USB_ENDPOINT_DESCRIPTOR(TALABARDINE_CONFIG1_DESCRIPTOR.midi_bulk_in),
+    USB_ENDPOINT_DESCRIPTOR(TALABARDINE_CONFIG1_DESCRIPTOR.midi_bulk_out)
 };
+_Static_assert(USB_STRLEN(TALABARDINE_CONFIG1_ENDPOINTS) == MIDI_STREAMING_ENDPOINTS, "Endpoint missing from the list");
+
+static const struct usb_configuration_t TALABARDINE_CONFIG1 = {
+    .descriptor = &TALABARDINE_CONFIG1_DESCRIPTOR.configuration,
+    .endpoints = TALABARDINE_CONFIG1_ENDPOINTS,
+    .n_endpoints = USB_STRLEN(TALABARDINE_CONFIG1_ENDPOINTS)
+};
+
 const struct __attribute__((aligned(4))) usb_qualifier_descriptor_t TALABARDINE_QUALIFIER_DESCRIPTOR = {
     .bLength = 10,
     .bDescriptorType = 0x6, // Device Qualifier Descriptor
@@ -181,22 +159,14 @@ const USB_UNICODE_DESCRIPTOR_T(TALABARDINE_MANUFACTURER, u"gberthou");
 const USB_UNICODE_DESCRIPTOR_T(TALABARDINE_PRODUCT, u"Talabardine");
 const USB_UNICODE_DESCRIPTOR_T(TALABARDINE_SERIAL, u"0000-0000");
 
-static volatile uint8_t bulk_input[64];
-
-static void usb_talabardine_on_set_configuration(uint16_t configIndex)
-{
-    (void) configIndex;
-    udc_endpoint_set_buffer(2, ENDPOINT_OUT, bulk_input);
-}
-
 void usb_talabardine_init(void)
 {
     udc_init();
-    usb_set_configuration_callback(usb_talabardine_on_set_configuration);
+    usb_init();
     
     usb_set_device_descriptor(&TALABARDINE_DEVICE_DESCRIPTOR);
     
-    usb_set_configuration_descriptor(1, &TALABARDINE_CONFIG1_DESCRIPTOR);
+    usb_set_configuration(1, &TALABARDINE_CONFIG1);
     
     usb_set_string_descriptor(0, &TALABARDINE_LANGID_DESCRIPTOR);
     usb_set_string_descriptor(1, &TALABARDINE_MANUFACTURER);